@@ -0,0 +1,401 @@
+// ndppd - NDP Proxy Daemon
+// Copyright (C) 2011  Daniel Adolfsson <daniel@priv.nu>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#pragma once
+
+#include <new>
+#include <cstring>
+#include <cstdlib>
+#include <stdint.h>
+#include <netinet/in.h>
+
+#ifdef __SSE2__
+#   include <emmintrin.h>
+#endif
+
+#include "ndppd.h"
+
+NDPPD_NS_BEGIN
+
+// Open-addressing hash table keyed on a full 128-bit IPv6 address.
+//
+// The layout follows the "Swiss table" design: next to the slot array
+// there is one control byte per slot that is either EMPTY, DELETED or
+// the low 7 bits of the key's hash. Lookups scan the control bytes 16 at
+// a time and only compare keys whose 7-bit tag matches, so a probe almost
+// never touches more than one slot.
+template <typename V>
+class addr_map {
+public:
+    class iterator {
+    public:
+        iterator() :
+            _map(0), _i(0)
+        {
+        }
+
+        const struct in6_addr& key() const
+        {
+            return _map->_slots[_i].key;
+        }
+
+        V& value() const
+        {
+            return _map->_slots[_i].value;
+        }
+
+        iterator& operator++()
+        {
+            _i = _map->next_full(_i + 1);
+            return *this;
+        }
+
+        bool operator==(const iterator& it) const
+        {
+            return _i == it._i;
+        }
+
+        bool operator!=(const iterator& it) const
+        {
+            return _i != it._i;
+        }
+
+    private:
+        friend class addr_map;
+
+        iterator(addr_map* map, size_t i) :
+            _map(map), _i(i)
+        {
+        }
+
+        addr_map* _map;
+
+        size_t _i;
+    };
+
+    addr_map() :
+        _ctrl(0), _slots(0), _capacity(0), _size(0), _growth_left(0)
+    {
+    }
+
+    ~addr_map()
+    {
+        clear();
+        free(_ctrl);
+        free(_slots);
+    }
+
+    size_t size() const
+    {
+        return _size;
+    }
+
+    bool empty() const
+    {
+        return !_size;
+    }
+
+    iterator begin()
+    {
+        return iterator(this, next_full(0));
+    }
+
+    iterator end()
+    {
+        return iterator(this, _capacity);
+    }
+
+    // Returns a pointer to the value stored under key, or NULL.
+    V* find(const struct in6_addr& key)
+    {
+        size_t i = lookup(key);
+        return (i < _capacity) ? &_slots[i].value : 0;
+    }
+
+    V* find(const address& addr)
+    {
+        return find(addr.const_addr());
+    }
+
+    // Returns the value stored under key, inserting a default-constructed
+    // one if there is none.
+    V& operator[](const struct in6_addr& key)
+    {
+        size_t i = lookup(key);
+
+        if (i < _capacity)
+            return _slots[i].value;
+
+        // insert_new() may move the slot array.
+        i = insert_new(key, V());
+        return _slots[i].value;
+    }
+
+    V& operator[](const address& addr)
+    {
+        return (*this)[addr.const_addr()];
+    }
+
+    // Stores value under key, replacing any previous value.
+    void insert(const struct in6_addr& key, const V& value)
+    {
+        size_t i = lookup(key);
+
+        if (i < _capacity)
+            _slots[i].value = value;
+        else
+            insert_new(key, value);
+    }
+
+    void insert(const address& addr, const V& value)
+    {
+        insert(addr.const_addr(), value);
+    }
+
+    bool erase(const struct in6_addr& key)
+    {
+        size_t i = lookup(key);
+
+        if (i >= _capacity)
+            return false;
+
+        erase_at(i);
+        return true;
+    }
+
+    bool erase(const address& addr)
+    {
+        return erase(addr.const_addr());
+    }
+
+    // Erases the element at it. Iterators to other elements stay valid.
+    void erase(iterator it)
+    {
+        erase_at(it._i);
+    }
+
+    void clear()
+    {
+        for (size_t i = 0; i < _capacity; i++) {
+            if (is_full(_ctrl[i]))
+                _slots[i].~slot();
+        }
+
+        if (_capacity)
+            memset(_ctrl, EMPTY, _capacity + GROUP);
+
+        _size        = 0;
+        _growth_left = max_load(_capacity);
+    }
+
+    static uint64_t hash(const struct in6_addr& key)
+    {
+        return address::hash(key);
+    }
+
+private:
+    enum {
+        GROUP   = 16,
+        EMPTY   = 0x80,
+        DELETED = 0xfe
+    };
+
+    struct slot {
+        struct in6_addr key;
+        V value;
+
+        slot(const struct in6_addr& k, const V& v) :
+            key(k), value(v)
+        {
+        }
+    };
+
+    // _capacity + GROUP control bytes; the last GROUP mirror the first
+    // ones so a group can always be loaded with a single read.
+    uint8_t* _ctrl;
+
+    slot* _slots;
+
+    size_t _capacity, _size, _growth_left;
+
+    static bool is_full(uint8_t c)
+    {
+        return !(c & 0x80);
+    }
+
+    static size_t max_load(size_t capacity)
+    {
+        return capacity - capacity / 8;
+    }
+
+    // Returns a bitmask with bit n set if ctrl[n] == c, for n < GROUP.
+    static unsigned int match(const uint8_t* ctrl, uint8_t c)
+    {
+#ifdef __SSE2__
+        __m128i g = _mm_loadu_si128((const __m128i* )ctrl);
+        return _mm_movemask_epi8(_mm_cmpeq_epi8(g, _mm_set1_epi8((char)c)));
+#else
+        unsigned int mask = 0;
+
+        for (int n = 0; n < GROUP; n++) {
+            if (ctrl[n] == c)
+                mask |= 1 << n;
+        }
+
+        return mask;
+#endif
+    }
+
+    static bool same(const struct in6_addr& a, const struct in6_addr& b)
+    {
+        return !memcmp(&a, &b, sizeof(struct in6_addr));
+    }
+
+    void set_ctrl(size_t i, uint8_t c)
+    {
+        _ctrl[i] = c;
+
+        if (i < GROUP)
+            _ctrl[_capacity + i] = c;
+    }
+
+    size_t next_full(size_t i) const
+    {
+        while ((i < _capacity) && !is_full(_ctrl[i]))
+            i++;
+
+        return i;
+    }
+
+    // Returns the slot index holding key, or _capacity if it's absent.
+    size_t lookup(const struct in6_addr& key) const
+    {
+        if (!_size)
+            return _capacity;
+
+        uint64_t h = hash(key);
+        size_t mask = _capacity - 1, pos = (h >> 7) & mask, step = 0;
+        uint8_t tag = h & 0x7f;
+
+        for (;;) {
+            for (unsigned int m = match(&_ctrl[pos], tag); m; m &= m - 1) {
+                size_t i = (pos + __builtin_ctz(m)) & mask;
+
+                if (same(_slots[i].key, key))
+                    return i;
+            }
+
+            if (match(&_ctrl[pos], EMPTY))
+                return _capacity;
+
+            step += GROUP;
+            pos = (pos + step) & mask;
+        }
+    }
+
+    // Returns the first EMPTY or DELETED slot on key's probe sequence.
+    size_t find_free(uint64_t h) const
+    {
+        size_t mask = _capacity - 1, pos = (h >> 7) & mask, step = 0;
+
+        for (;;) {
+            unsigned int m = match(&_ctrl[pos], EMPTY) | match(&_ctrl[pos], DELETED);
+
+            if (m)
+                return (pos + __builtin_ctz(m)) & mask;
+
+            step += GROUP;
+            pos = (pos + step) & mask;
+        }
+    }
+
+    size_t insert_new(const struct in6_addr& key, const V& value)
+    {
+        if (!_growth_left)
+            rehash((_size * 2 >= _capacity) ? (_capacity ? _capacity * 2 : GROUP) : _capacity);
+
+        uint64_t h = hash(key);
+        size_t i = find_free(h);
+
+        if (_ctrl[i] == EMPTY)
+            _growth_left--;
+
+        set_ctrl(i, h & 0x7f);
+        new (&_slots[i]) slot(key, value);
+        _size++;
+
+        return i;
+    }
+
+    void erase_at(size_t i)
+    {
+        _slots[i].~slot();
+        _size--;
+
+        // If the group around this slot still has an empty slot, no probe
+        // sequence can run past it, so it may be marked EMPTY again.
+        size_t mask = _capacity - 1;
+        size_t before = (i - GROUP) & mask;
+
+        if (match(&_ctrl[i], EMPTY) && match(&_ctrl[before], EMPTY) &&
+            (__builtin_ctz(match(&_ctrl[i], EMPTY)) + __builtin_clz(match(&_ctrl[before], EMPTY) << 16) < GROUP)) {
+            set_ctrl(i, EMPTY);
+            _growth_left++;
+        } else {
+            set_ctrl(i, DELETED);
+        }
+    }
+
+    // Moves every element into a table with new_capacity slots, dropping
+    // all DELETED markers on the way.
+    void rehash(size_t new_capacity)
+    {
+        uint8_t* old_ctrl = _ctrl;
+        slot* old_slots   = _slots;
+        size_t old_cap    = _capacity;
+
+        _capacity    = new_capacity;
+        _ctrl        = (uint8_t* )malloc(_capacity + GROUP);
+        _slots       = (slot* )malloc(_capacity * sizeof(slot));
+        _growth_left = max_load(_capacity);
+
+        if (!_ctrl || !_slots)
+            throw std::bad_alloc();
+
+        memset(_ctrl, EMPTY, _capacity + GROUP);
+
+        for (size_t i = 0; i < old_cap; i++) {
+            if (!is_full(old_ctrl[i]))
+                continue;
+
+            uint64_t h = hash(old_slots[i].key);
+            size_t j = find_free(h);
+
+            set_ctrl(j, h & 0x7f);
+            new (&_slots[j]) slot(old_slots[i].key, old_slots[i].value);
+            old_slots[i].~slot();
+            _growth_left--;
+        }
+
+        free(old_ctrl);
+        free(old_slots);
+    }
+
+    addr_map(const addr_map&);
+
+    addr_map& operator=(const addr_map&);
+};
+
+NDPPD_NS_END
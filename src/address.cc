@@ -15,9 +15,7 @@
 // along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <string>
 #include <vector>
-#include <fstream>
-#include <list>
-#include <map>
+#include <algorithm>
 
 #include <cstring>
 #include <cstdio>
@@ -29,15 +27,13 @@
 
 #include "ndppd.h"
 #include "address.h"
-#include "route.h"
+#include "addr_map.h"
 
 NDPPD_NS_BEGIN
 
-std::list<ptr<route> > address::_addresses;
+addr_map<std::vector<int> > address::_addresses;
 
-int address::_ttl;
-
-int address::_c_ttl;
+unsigned int address::_generation = 0;
 
 address::address()
 {
@@ -46,28 +42,9 @@ address::address()
 
 address::address(const address& addr)
 {
-    _addr.s6_addr32[0] = addr._addr.s6_addr32[0];
-    _addr.s6_addr32[1] = addr._addr.s6_addr32[1];
-    _addr.s6_addr32[2] = addr._addr.s6_addr32[2];
-    _addr.s6_addr32[3] = addr._addr.s6_addr32[3];
-
-    _mask.s6_addr32[0] = addr._mask.s6_addr32[0];
-    _mask.s6_addr32[1] = addr._mask.s6_addr32[1];
-    _mask.s6_addr32[2] = addr._mask.s6_addr32[2];
-    _mask.s6_addr32[3] = addr._mask.s6_addr32[3];
-}
-
-address::address(const ptr<address>& addr)
-{
-    _addr.s6_addr32[0] = addr->_addr.s6_addr32[0];
-    _addr.s6_addr32[1] = addr->_addr.s6_addr32[1];
-    _addr.s6_addr32[2] = addr->_addr.s6_addr32[2];
-    _addr.s6_addr32[3] = addr->_addr.s6_addr32[3];
-
-    _mask.s6_addr32[0] = addr->_mask.s6_addr32[0];
-    _mask.s6_addr32[1] = addr->_mask.s6_addr32[1];
-    _mask.s6_addr32[2] = addr->_mask.s6_addr32[2];
-    _mask.s6_addr32[3] = addr->_mask.s6_addr32[3];
+    _w[0]   = addr._w[0];
+    _w[1]   = addr._w[1];
+    _prefix = addr._prefix;
 }
 
 address::address(const std::string& str)
@@ -82,132 +59,54 @@ address::address(const char* str)
 
 address::address(const in6_addr& addr)
 {
-    _addr.s6_addr32[0] = addr.s6_addr32[0];
-    _addr.s6_addr32[1] = addr.s6_addr32[1];
-    _addr.s6_addr32[2] = addr.s6_addr32[2];
-    _addr.s6_addr32[3] = addr.s6_addr32[3];
-
-    _mask.s6_addr32[0] = 0xffffffff;
-    _mask.s6_addr32[1] = 0xffffffff;
-    _mask.s6_addr32[2] = 0xffffffff;
-    _mask.s6_addr32[3] = 0xffffffff;
+    _addr   = addr;
+    _prefix = 128;
 }
 
 address::address(const in6_addr& addr, const in6_addr& mask)
 {
-    _addr.s6_addr32[0] = addr.s6_addr32[0];
-    _addr.s6_addr32[1] = addr.s6_addr32[1];
-    _addr.s6_addr32[2] = addr.s6_addr32[2];
-    _addr.s6_addr32[3] = addr.s6_addr32[3];
-
-    _mask.s6_addr32[0] = mask.s6_addr32[0];
-    _mask.s6_addr32[1] = mask.s6_addr32[1];
-    _mask.s6_addr32[2] = mask.s6_addr32[2];
-    _mask.s6_addr32[3] = mask.s6_addr32[3];
-}
+    _addr = addr;
 
-address::address(const in6_addr& addr, int pf)
-{
-    _addr.s6_addr32[0] = addr.s6_addr32[0];
-    _addr.s6_addr32[1] = addr.s6_addr32[1];
-    _addr.s6_addr32[2] = addr.s6_addr32[2];
-    _addr.s6_addr32[3] = addr.s6_addr32[3];
+    // The prefix is the run of leading ones in the mask.
+    uint64_t m[2];
+    memcpy(m, &mask, sizeof(m));
 
-    prefix(pf);
-}
+    uint64_t hi = ~be64toh(m[0]), lo = ~be64toh(m[1]);
 
-bool address::operator==(const address& addr) const
-{
-    return !(((_addr.s6_addr32[0] ^ addr._addr.s6_addr32[0]) & _mask.s6_addr32[0]) |
-             ((_addr.s6_addr32[1] ^ addr._addr.s6_addr32[1]) & _mask.s6_addr32[1]) |
-             ((_addr.s6_addr32[2] ^ addr._addr.s6_addr32[2]) & _mask.s6_addr32[2]) |
-             ((_addr.s6_addr32[3] ^ addr._addr.s6_addr32[3]) & _mask.s6_addr32[3]));
+    if (hi)
+        _prefix = __builtin_clzll(hi);
+    else if (lo)
+        _prefix = 64 + __builtin_clzll(lo);
+    else
+        _prefix = 128;
 }
 
-bool address::operator!=(const address& addr) const
+address::address(const in6_addr& addr, int pf)
 {
-    return !!(((_addr.s6_addr32[0] ^ addr._addr.s6_addr32[0]) & _mask.s6_addr32[0]) |
-              ((_addr.s6_addr32[1] ^ addr._addr.s6_addr32[1]) & _mask.s6_addr32[1]) |
-              ((_addr.s6_addr32[2] ^ addr._addr.s6_addr32[2]) & _mask.s6_addr32[2]) |
-              ((_addr.s6_addr32[3] ^ addr._addr.s6_addr32[3]) & _mask.s6_addr32[3]));
+    _addr = addr;
+    prefix(pf);
 }
 
 bool address::is_empty() const
 {
-    if (_addr.s6_addr32[0] == 0 &&
-        _addr.s6_addr32[1] == 0 &&
-        _addr.s6_addr32[2] == 0 &&
-        _addr.s6_addr32[3] == 0 &&
-        _mask.s6_addr32[0] == 0xffffffff &&
-        _mask.s6_addr32[1] == 0xffffffff &&
-        _mask.s6_addr32[2] == 0xffffffff &&
-        _mask.s6_addr32[3] == 0xffffffff)
-        return true;
-        
-    return false;
+    return !_w[0] && !_w[1] && (_prefix == 128);
 }
 
 void address::reset()
 {
-    _addr.s6_addr32[0] = 0;
-    _addr.s6_addr32[1] = 0;
-    _addr.s6_addr32[2] = 0;
-    _addr.s6_addr32[3] = 0;
-
-    _mask.s6_addr32[0] = 0xffffffff;
-    _mask.s6_addr32[1] = 0xffffffff;
-    _mask.s6_addr32[2] = 0xffffffff;
-    _mask.s6_addr32[3] = 0xffffffff;
-}
-
-int address::prefix() const
-{
-    if (!_mask.s6_addr[0]) {
-        return 0;
-    }
-
-    for (int p = 0; p < 128; p++) {
-        int byi = p / 8, bii = 7 - (p % 8);
-
-        if (!(_mask.s6_addr[byi]&  (1 << bii))) {
-            return p;
-        }
-    }
-
-    return 128;
+    _w[0]   = 0;
+    _w[1]   = 0;
+    _prefix = 128;
 }
 
 void address::prefix(int pf)
 {
-    const unsigned char maskbit[] = {
-        0x00, 0x80, 0xc0, 0xe0, 0xf0,
-        0xf8, 0xfc, 0xfe, 0xff
-    };
-
-    if (pf >= 128) {
-        _mask.s6_addr32[0] = 0xffffffff;
-        _mask.s6_addr32[1] = 0xffffffff;
-        _mask.s6_addr32[2] = 0xffffffff;
-        _mask.s6_addr32[3] = 0xffffffff;
-        return;
-    } else {
-        _mask.s6_addr32[0] = 0;
-        _mask.s6_addr32[1] = 0;
-        _mask.s6_addr32[2] = 0;
-        _mask.s6_addr32[3] = 0;
-
-        if (pf <= 0) {
-            return;
-        }
-    }
+    if (pf < 0)
+        pf = 0;
+    else if (pf > 128)
+        pf = 128;
 
-    int offset = pf / 8, n;
-
-    for (n = 0; n < offset; n++) {
-        _mask.s6_addr[n] = 0xff;
-    }
-
-    _mask.s6_addr[offset] = maskbit[pf % 8];
+    _prefix = pf;
 }
 
 const std::string address::to_string() const
@@ -272,10 +171,7 @@ bool address::parse_string(const std::string& str)
     }
 
     if (*p == '\0') {
-        _mask.s6_addr32[0] = 0xffffffff;
-        _mask.s6_addr32[1] = 0xffffffff;
-        _mask.s6_addr32[2] = 0xffffffff;
-        _mask.s6_addr32[3] = 0xffffffff;
+        _prefix = 128;
         return true;
     }
 
@@ -324,9 +220,14 @@ const struct in6_addr& address::const_addr() const
     return _addr;
 }
 
-struct in6_addr& address::mask()
+struct in6_addr address::mask() const
 {
-    return _mask;
+    struct in6_addr mask;
+
+    uint64_t m[2] = { mask_word(_prefix), mask_word(_prefix - 64) };
+    memcpy(&mask, m, sizeof(mask));
+
+    return mask;
 }
 
 bool address::is_multicast() const
@@ -343,86 +244,90 @@ bool address::is_unicast() const
     return _addr.s6_addr[0] != 0xff;
 }
 
-void address::add(const address& addr, const std::string& ifname)
+bool address::is_link_local() const
 {
-    ptr<route> rt(new route(addr, ifname));
-    // logger::debug() << "address::create() addr=" << addr << ", ifname=" << ifname;
-    _addresses.push_back(rt);
+    return (_addr.s6_addr[0] == 0xfe) && ((_addr.s6_addr[1] & 0xc0) == 0x80);
 }
 
-std::list<ptr<route> >::iterator address::addresses_begin()
+void address::add(const address& addr, int ifindex)
 {
-    return _addresses.begin();
+    std::vector<int>& ifindexes = _addresses[addr];
+
+    if (std::find(ifindexes.begin(), ifindexes.end(), ifindex) == ifindexes.end()) {
+        NDPPD_DEBUG << "address::add() addr=" << addr << ", ifindex=" << ifindex;
+        ifindexes.push_back(ifindex);
+        _generation++;
+    }
 }
 
-std::list<ptr<route> >::iterator address::addresses_end()
+void address::remove(const address& addr, int ifindex)
 {
-    return _addresses.end();
+    std::vector<int>* ifindexes = _addresses.find(addr);
+
+    if (!ifindexes)
+        return;
+
+    std::vector<int>::iterator it =
+        std::find(ifindexes->begin(), ifindexes->end(), ifindex);
+
+    if (it == ifindexes->end())
+        return;
+
+    NDPPD_DEBUG << "address::remove() addr=" << addr << ", ifindex=" << ifindex;
+
+    ifindexes->erase(it);
+    _generation++;
+
+    if (ifindexes->empty())
+        _addresses.erase(addr);
 }
 
-void address::load(const std::string& path)
+void address::clear()
 {
-    // Hack to make sure the addresses are not freed prematurely.
-    std::list<ptr<route> > tmp_addresses(_addresses);
     _addresses.clear();
+    _generation++;
+}
 
-    logger::debug() << "reading IP addresses";
-
-    try {
-        std::ifstream ifs;
-        ifs.exceptions(std::ifstream::badbit | std::ifstream::failbit);
-        ifs.open(path.c_str(), std::ios::in);
-        ifs.exceptions(std::ifstream::badbit);
-
-        while (!ifs.eof()) {
-            char buf[1024];
-            ifs.getline(buf, sizeof(buf));
-
-            if (ifs.gcount() < 53) {
-                if (ifs.gcount() > 0)
-                    logger::debug() << "skipping entry (size=" << ifs.gcount() << ")";
-                continue;
-            }
-
-            address addr;
-
-            if (route::hexdec(buf, (unsigned char* )&addr.addr(), 16) != 16) {
-                logger::warning() << "failed to load address (" << buf << ")";
-                continue;
-            }
-            
-            addr.prefix(128);
-            
-            std::string iface = route::token(buf + 45);
-
-            address::add(addr, iface);
-            
-            logger::debug() << "found local addr=" << addr << ", iface=" << iface;
-        }
-    } catch (std::ifstream::failure e) {
-        logger::warning() << "Failed to parse IPv6 address data from '" << path << "'";
-        logger::error() << e.what();
+bool address::is_local(const address& addr)
+{
+    return _addresses.find(addr) != 0;
+}
+
+void address::find_all(int ifindex, std::vector<address>& out)
+{
+    for (addr_map<std::vector<int> >::iterator it = _addresses.begin();
+            it != _addresses.end(); ++it) {
+        if (std::find(it.value().begin(), it.value().end(), ifindex) != it.value().end())
+            out.push_back(address(it.key()));
     }
-    
-    logger::debug() << "completed IP addresses load";
 }
 
-void address::update(int elapsed_time)
+bool address::find_link_local(int ifindex, address& out)
 {
-    if ((_c_ttl -= elapsed_time) <= 0) {
-        load("/proc/net/if_inet6");
-        _c_ttl = _ttl;
+    for (addr_map<std::vector<int> >::iterator it = _addresses.begin();
+            it != _addresses.end(); ++it) {
+        address addr(it.key());
+
+        if (addr.is_link_local() &&
+                (std::find(it.value().begin(), it.value().end(), ifindex) != it.value().end())) {
+            out = addr;
+            return true;
+        }
     }
+
+    return false;
 }
 
-int address::ttl()
+unsigned int address::generation()
 {
-    return _ttl;
+    return _generation;
 }
 
-void address::ttl(int ttl)
+bool address::is_local(const address& addr, int ifindex)
 {
-    _ttl = ttl;
+    std::vector<int>* ifindexes = _addresses.find(addr);
+
+    return ifindexes && (std::find(ifindexes->begin(), ifindexes->end(), ifindex) != ifindexes->end());
 }
 
 NDPPD_NS_END
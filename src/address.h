@@ -16,8 +16,11 @@
 #pragma once
 
 #include <string>
-#include <list>
+#include <vector>
+#include <cstring>
 #include <netinet/ip6.h>
+#include <endian.h>
+#include <stdint.h>
 
 #include "ndppd.h"
 
@@ -27,33 +30,61 @@ class iface;
 
 class route;
 
+template <typename V> class addr_map;
+
+// An IPv6 address with a prefix length. The address is kept as two
+// 64-bit words in network byte order, so that compares and hashing work
+// on whole words, and the prefix as a single byte rather than a mask.
 class address {
 public:
     address();
     address(const address& addr);
-    address(const ptr<address>& addr);
     address(const std::string& str);
     address(const char* str);
     address(const in6_addr& addr);
     address(const in6_addr& addr, const in6_addr& mask);
     address(const in6_addr& addr, int prefix);
     
-    static void update(int elapsed_time);
-
-    static int ttl();
-
-    static void ttl(int ttl);
-
     struct in6_addr& addr();
 
     const struct in6_addr& const_addr() const;
 
-    struct in6_addr& mask();
-
-    // Compare _a/_m against a._a.
-    bool operator==(const address& addr) const;
-
-    bool operator!=(const address& addr) const;
+    // The netmask for prefix().
+    struct in6_addr mask() const;
+
+    // Compares the first prefix() bits of this address against addr,
+    // whatever the prefix of addr is.
+    bool operator==(const address& addr) const
+    {
+        return !(((_w[0] ^ addr._w[0]) & mask_word(_prefix)) |
+                 ((_w[1] ^ addr._w[1]) & mask_word(_prefix - 64)));
+    }
+
+    bool operator!=(const address& addr) const
+    {
+        return !(*this == addr);
+    }
+
+    // Hash of the address itself; the prefix is not included.
+    uint64_t hash() const
+    {
+        return hash(_addr);
+    }
+
+    static uint64_t hash(const struct in6_addr& addr)
+    {
+        uint64_t a, b;
+        memcpy(&a, &addr.s6_addr[0], 8);
+        memcpy(&b, &addr.s6_addr[8], 8);
+
+        uint64_t h = (a * 0x9e3779b97f4a7c15ULL) ^ (b + 0xc2b2ae3d27d4eb4fULL);
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ULL;
+        h ^= h >> 33;
+        return h;
+    }
 
     void reset();
     
@@ -63,7 +94,10 @@ public:
 
     bool parse_string(const std::string& str);
 
-    int prefix() const;
+    int prefix() const
+    {
+        return _prefix;
+    }
 
     void prefix(int n);
 
@@ -73,22 +107,57 @@ public:
 
     operator std::string() const;
     
-    static void add(const address& addr, const std::string& ifname);
-    
-    static void load(const std::string& path);
-    
-    static std::list<ptr<route> >::iterator addresses_begin();
-    
-    static std::list<ptr<route> >::iterator addresses_end();
+    // Records that addr is assigned to the local interface with the
+    // kernel index ifindex.
+    static void add(const address& addr, int ifindex);
+
+    static void remove(const address& addr, int ifindex);
+
+    static void clear();
+
+    // Returns true if addr is assigned to any local interface.
+    static bool is_local(const address& addr);
+
+    // Returns true if addr is assigned to the local interface ifindex.
+    static bool is_local(const address& addr, int ifindex);
+
+    // Appends every address assigned to ifindex to out.
+    static void find_all(int ifindex, std::vector<address>& out);
+
+    // Stores a link-local address assigned to ifindex in out. Returns
+    // false if the interface has none.
+    static bool find_link_local(int ifindex, address& out);
+
+    // Changes whenever a local address is added or removed.
+    static unsigned int generation();
+
+    bool is_link_local() const;
 
 private:
-    static int _ttl;
+    static unsigned int _generation;
 
-    static int _c_ttl;
-    
-    static std::list<ptr<route> > _addresses;
-    
-    struct in6_addr _addr, _mask;
+    // Local addresses, kept current by rtnl, with the indexes of the
+    // interfaces they are assigned to.
+    static addr_map<std::vector<int> > _addresses;
+
+    union {
+        struct in6_addr _addr;
+        uint64_t _w[2];
+    };
+
+    uint8_t _prefix;
+
+    // Mask for the first bits bits of a word, in network byte order.
+    static uint64_t mask_word(int bits)
+    {
+        if (bits <= 0)
+            return 0;
+
+        if (bits >= 64)
+            return ~0ULL;
+
+        return htobe64(~0ULL << (64 - bits));
+    }
 };
 
 NDPPD_NS_END
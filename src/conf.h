@@ -25,7 +25,7 @@
 
 NDPPD_NS_BEGIN
 
-class conf {
+class conf : public ref_counted {
 public:
 
 private:
@@ -24,45 +24,86 @@
 #include <netinet/ip6.h>
 #include <netinet/icmp6.h>
 #include <netinet/ether.h>
-#include <netpacket/packet.h>
 
 #include <net/if.h>
 #include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/socket.h>
-#include <sys/poll.h>
+#include <sys/mman.h>
 
 #include <linux/filter.h>
+#include <linux/if_packet.h>
 
 #include <errno.h>
 #include <string>
 #include <vector>
 #include <map>
+#include <algorithm>
 
 #include "ndppd.h"
 #include "route.h"
+#include "poller.h"
+#include "timer.h"
 
 NDPPD_NS_BEGIN
 
 std::map<std::string, weak_ptr<iface> > iface::_map;
 
-bool iface::_map_dirty = false;
+std::vector<iface*> iface::_ids;
 
-std::vector<struct pollfd> iface::_pollfds;
+int iface::_rx_batch = 32;
+
+std::vector<struct mmsghdr> iface::_rx_msgs;
+
+std::vector<struct iovec> iface::_rx_iov;
+
+std::vector<struct sockaddr_storage> iface::_rx_names;
+
+std::vector<uint8_t> iface::_rx_buf;
+
+std::vector<ptr<iface> > iface::_tx_pending;
+
+bool iface::_filters_dirty = true;
+
+bool iface::_dispatch_dirty = true;
+
+unsigned int iface::_filters_generation = 0;
+
+int iface::_fanout_group = 0;
+
+int iface::_fanout_workers = 1;
 
 iface::iface() :
-    _ifd(-1), _pfd(-1), _name("")
+    _tx_packets(0), _tx_calls(0), _tx_direct(0), _tx_dropped(0), _src_generation(0),
+    _ring(NULL), _ring_block_size(0), _ring_block_nr(0), _ring_block(0), _rx_packets(0), _rx_calls(0), _rx_max(0),
+    _ifd(-1), _pfd(-1), _name(""),
+    _ifindex(0), _generation(1)
 {
+    for (_id = 0; _id < (int)_ids.size(); _id++) {
+        if (!_ids[_id])
+            break;
+    }
+
+    if (_id == (int)_ids.size())
+        _ids.push_back(this);
+    else
+        _ids[_id] = this;
+
+    _tx_retry.bind<iface, &iface::retry_flush>(this);
 }
 
 iface::~iface()
 {
-    logger::debug() << "iface::~iface()";
+    NDPPD_DEBUG << "iface::~iface()";
 
-    if (_ifd >= 0)
+    if (_ifd >= 0) {
+        poller::remove(_ifd);
         close(_ifd);
+    }
 
     if (_pfd >= 0) {
+        poller::remove(_pfd);
+
         if (_prev_allmulti >= 0) {
             allmulti(_prev_allmulti);
         }
@@ -72,13 +113,17 @@ iface::~iface()
         close(_pfd);
     }
 
-    _map_dirty = true;
-    
+    if (_ring) {
+        munmap(_ring, _ring_block_size * _ring_block_nr);
+    }
+
     _serves.clear();
     _parents.clear();
+
+    _ids[_id] = 0;
 }
 
-ptr<iface> iface::open_pfd(const std::string& name, bool promiscuous)
+ptr<iface> iface::open_pfd(const std::string& name, bool promiscuous, bool rx_ring)
 {
     int fd = 0;
 
@@ -86,7 +131,7 @@ ptr<iface> iface::open_pfd(const std::string& name, bool promiscuous)
 
     ptr<iface> ifa;
 
-    if (it != _map.end()) {
+    if ((it != _map.end()) && it->second) {
         if (it->second->_pfd >= 0)
             return it->second;
 
@@ -114,11 +159,7 @@ ptr<iface> iface::open_pfd(const std::string& name, bool promiscuous)
     lladdr.sll_family   = AF_PACKET;
     lladdr.sll_protocol = htons(ETH_P_IPV6);
 
-    if (!(lladdr.sll_ifindex = if_nametoindex(name.c_str()))) {
-        close(fd);
-        logger::error() << "Failed to bind to interface '" << name << "'";
-        return ptr<iface>();
-    }
+    lladdr.sll_ifindex  = ifa->_ifindex;
 
     if (bind(fd, (struct sockaddr* )&lladdr, sizeof(struct sockaddr_ll)) < 0) {
         close(fd);
@@ -136,37 +177,17 @@ ptr<iface> iface::open_pfd(const std::string& name, bool promiscuous)
         return ptr<iface>();
     }
 
-    // Set up filter.
+    // Set up the receive ring, if requested; fall back to recvmmsg()
+    // when the kernel won't give us one.
 
-    static struct sock_filter filter[] = {
-        // Load the ether_type.
-        BPF_STMT(BPF_LD | BPF_H | BPF_ABS,
-            offsetof(struct ether_header, ether_type)),
-        // Bail if it's* not* ETHERTYPE_IPV6.
-        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ETHERTYPE_IPV6, 0, 5),
-        // Load the next header type.
-        BPF_STMT(BPF_LD | BPF_B | BPF_ABS,
-            sizeof(struct ether_header) + offsetof(struct ip6_hdr, ip6_nxt)),
-        // Bail if it's* not* IPPROTO_ICMPV6.
-        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_ICMPV6, 0, 3),
-        // Load the ICMPv6 type.
-        BPF_STMT(BPF_LD | BPF_B | BPF_ABS,
-            sizeof(struct ether_header) + sizeof(ip6_hdr) + offsetof(struct icmp6_hdr, icmp6_type)),
-        // Bail if it's* not* ND_NEIGHBOR_SOLICIT.
-        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ND_NEIGHBOR_SOLICIT, 0, 1),
-        // Keep packet.
-        BPF_STMT(BPF_RET | BPF_K, (u_int32_t)-1),
-        // Drop packet.
-        BPF_STMT(BPF_RET | BPF_K, 0)
-    };
-
-    static struct sock_fprog fprog = {
-        8,
-        filter
-    };
+    if (rx_ring && !ifa->setup_ring(fd)) {
+        logger::warning()
+            << "Failed to set up rx-ring on interface '" << name
+            << "', falling back to regular reads";
+    }
 
-    if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof(fprog)) < 0) {
-        logger::error() << "Failed to set filter";
+    if ((_fanout_workers > 1) && !join_fanout(fd, lladdr.sll_ifindex, name)) {
+        close(fd);
         return ptr<iface>();
     }
 
@@ -174,6 +195,15 @@ ptr<iface> iface::open_pfd(const std::string& name, bool promiscuous)
 
     ifa->_pfd = fd;
 
+    // Nothing passes until the rules are known; see update_filters().
+    ifa->update_filter();
+
+    if (!poller::add<iface, &iface::handle_pfd>(fd, ifa)) {
+        ifa->_pfd = -1;
+        close(fd);
+        return ptr<iface>();
+    }
+
     // Eh. Allmulti.
     ifa->_prev_allmulti = ifa->allmulti(1);
     
@@ -184,8 +214,6 @@ ptr<iface> iface::open_pfd(const std::string& name, bool promiscuous)
         ifa->_prev_promiscuous = -1;
     }
 
-    _map_dirty = true;
-
     return ifa;
 }
 
@@ -195,8 +223,16 @@ ptr<iface> iface::open_ifd(const std::string& name)
 
     std::map<std::string, weak_ptr<iface> >::iterator it = _map.find(name);
 
-    if ((it != _map.end()) && it->second->_ifd)
-        return it->second;
+    if (it != _map.end()) {
+        if (it->second && (it->second->_ifd >= 0))
+            return it->second;
+
+        // Stale entry left behind by an interface that has been closed.
+        if (!it->second) {
+            _map.erase(it);
+            it = _map.end();
+        }
+    }
 
     // Create a socket.
 
@@ -213,7 +249,10 @@ ptr<iface> iface::open_ifd(const std::string& name)
     strncpy(ifr.ifr_name, name.c_str(), IFNAMSIZ - 1);
     ifr.ifr_name[IFNAMSIZ - 1] = '\0';
 
-    if (setsockopt(fd, SOL_SOCKET, SO_BINDTODEVICE,& ifr, sizeof(ifr)) < 0) {
+    int ifindex;
+
+    if (!(ifindex = if_nametoindex(name.c_str())) ||
+            (setsockopt(fd, SOL_SOCKET, SO_BINDTODEVICE,& ifr, sizeof(ifr)) < 0)) {
         close(fd);
         logger::error() << "Failed to bind to interface '" << name << "'";
         return ptr<iface>();
@@ -233,7 +272,7 @@ ptr<iface> iface::open_ifd(const std::string& name)
         return ptr<iface>();
     }
 
-    logger::debug()
+    NDPPD_DEBUG
         << "fd=" << fd << ", hwaddr="
         << ether_ntoa((const struct ether_addr* )&ifr.ifr_hwaddr.sa_data);
 
@@ -274,6 +313,7 @@ ptr<iface> iface::open_ifd(const std::string& name)
     ICMP6_FILTER_SETPASS(ND_NEIGHBOR_ADVERT, &filter);
 
     if (setsockopt(fd, IPPROTO_ICMPV6, ICMP6_FILTER,& filter, sizeof(filter)) < 0) {
+        close(fd);
         logger::error() << "Failed to set filter";
         return ptr<iface>();
     }
@@ -292,124 +332,491 @@ ptr<iface> iface::open_ifd(const std::string& name)
         ifa = it->second;
     }
 
-    ifa->_ifd = fd;
+    ifa->_ifd     = fd;
+    ifa->_ifindex = ifindex;
 
     memcpy(&ifa->hwaddr, ifr.ifr_hwaddr.sa_data, sizeof(struct ether_addr));
 
-    _map_dirty = true;
+    if (!poller::add<iface, &iface::handle_ifd>(fd, ifa)) {
+        ifa->_ifd = -1;
+        close(fd);
+        return ptr<iface>();
+    }
 
     return ifa;
 }
 
-ssize_t iface::read(int fd, struct sockaddr* saddr, ssize_t saddr_size, uint8_t* msg, size_t size)
+int iface::rx_batch()
 {
-    struct msghdr mhdr;
-    struct iovec iov;
-    int len;
+    return _rx_batch;
+}
 
-    if (!msg || (size < 0))
-        return -1;
+void iface::rx_batch(int n)
+{
+    _rx_batch = (n < 1) ? 1 : ((n > 1024) ? 1024 : n);
+}
 
-    iov.iov_len = size;
-    iov.iov_base = (caddr_t)msg;
+int iface::read(int fd)
+{
+    if (_rx_msgs.size() != (size_t)_rx_batch) {
+        _rx_msgs.resize(_rx_batch);
+        _rx_iov.resize(_rx_batch);
+        _rx_names.resize(_rx_batch);
+        _rx_buf.resize(_rx_batch * RX_BUF_SIZE);
+
+        memset(&_rx_msgs[0], 0, _rx_batch * sizeof(struct mmsghdr));
+
+        for (int i = 0; i < _rx_batch; i++) {
+            _rx_iov[i].iov_base = &_rx_buf[i * RX_BUF_SIZE];
+            _rx_iov[i].iov_len  = RX_BUF_SIZE;
+            _rx_msgs[i].msg_hdr.msg_name   = &_rx_names[i];
+            _rx_msgs[i].msg_hdr.msg_iov    = &_rx_iov[i];
+            _rx_msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+    }
+
+    for (int i = 0; i < _rx_batch; i++) {
+        _rx_msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+    }
+
+    int n;
+
+    if ((n = recvmmsg(fd, &_rx_msgs[0], _rx_batch, MSG_DONTWAIT, NULL)) < 0) {
+        // Running dry is the normal way out of an edge-triggered drain.
+        if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+            return 0;
 
-    memset(&mhdr, 0, sizeof(mhdr));
-    mhdr.msg_name = (caddr_t)saddr;
-    mhdr.msg_namelen = saddr_size;
-    mhdr.msg_iov =& iov;
-    mhdr.msg_iovlen = 1;
-    
-    if ((len = recvmsg(fd,& mhdr, 0)) < 0)
-    {
         logger::error() << "iface::read() failed! error=" << logger::err() << ", ifa=" << name();
         return -1;
     }
-    
-    logger::debug() << "iface::read() ifa=" << name() << ", len=" << len;
 
-    if (len < sizeof(struct icmp6_hdr))
+    NDPPD_DEBUG << "iface::read() ifa=" << name() << ", count=" << n;
+
+    if (n > 0) {
+        _rx_packets += n;
+        _rx_calls++;
+
+        if (n > _rx_max)
+            _rx_max = n;
+    }
+
+    return n;
+}
+
+ssize_t iface::write(const address& daddr, const uint8_t* msg, size_t size)
+{
+    if (size > TX_BUF_SIZE)
+        return -1;
+
+    NDPPD_DEBUG << "iface::write() ifa=" << name() << ", daddr=" << daddr.to_string() << ", len="
+                    << (int)size;
+
+    if (_txq.size() >= TX_QUEUE_MAX) {
+        _tx_dropped++;
         return -1;
+    }
+
+    if (_txq.empty() && _ftxq.empty())
+        _tx_pending.push_back(_ptr);
+
+    _txq.resize(_txq.size() + 1);
 
-    return len;
+    tx_msg& m = _txq.back();
+
+    memset(&m.daddr, 0, sizeof(struct sockaddr_in6));
+    m.daddr.sin6_family = AF_INET6;
+    m.daddr.sin6_port   = htons(IPPROTO_ICMPV6); // Needed?
+    memcpy(&m.daddr.sin6_addr,& daddr.const_addr(), sizeof(struct in6_addr));
+
+    memcpy(m.buf, msg, size);
+    m.len = size;
+
+    return size;
 }
 
-ssize_t iface::write(int fd, const address& daddr, const uint8_t* msg, size_t size)
+// Adds the 16-bit big-endian words of data to the one's complement
+// sum. Carries are folded in by checksum_fold().
+static uint32_t checksum_add(uint32_t sum, const uint8_t* data, size_t len)
 {
-    struct sockaddr_in6 daddr_tmp;
-    struct msghdr mhdr;
-    struct iovec iov;
+    for (size_t i = 0; i + 1 < len; i += 2)
+        sum += (data[i] << 8) | data[i + 1];
 
-    memset(&daddr_tmp, 0, sizeof(struct sockaddr_in6));
-    daddr_tmp.sin6_family = AF_INET6;
-    daddr_tmp.sin6_port   = htons(IPPROTO_ICMPV6); // Needed?
-    memcpy(&daddr_tmp.sin6_addr,& daddr.const_addr(), sizeof(struct in6_addr));
+    if (len & 1)
+        sum += data[len - 1] << 8;
 
-    iov.iov_len = size;
-    iov.iov_base = (caddr_t)msg;
+    return sum;
+}
 
-    memset(&mhdr, 0, sizeof(mhdr));
-    mhdr.msg_name = (caddr_t)&daddr_tmp;
-    mhdr.msg_namelen = sizeof(sockaddr_in6);
-    mhdr.msg_iov =& iov;
-    mhdr.msg_iovlen = 1;
+static uint16_t checksum_fold(uint32_t sum)
+{
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+
+    return htons(~sum & 0xffff);
+}
 
-    logger::debug() << "iface::write() ifa=" << name() << ", daddr=" << daddr.to_string() << ", len="
-                    << size;
+// Sums an ICMPv6 message (with a zero checksum field) and the parts of
+// the pseudo-header that don't depend on the addresses.
+static uint32_t checksum_msg(const uint8_t* msg, size_t len)
+{
+    return checksum_add((len >> 16) + (len & 0xffff) + IPPROTO_ICMPV6, msg, len);
+}
 
-    int len;
+ssize_t iface::write_direct(const struct ether_addr& hwdaddr, const address& saddr,
+                            const address& daddr, const uint8_t* msg, size_t size)
+{
+    uint8_t buf[TX_BUF_SIZE];
 
-    if ((len = sendmsg(fd,& mhdr, 0)) < 0)
-    {
-        logger::error() << "iface::write() failed! error=" << logger::err() << ", ifa=" << name() << ", daddr=" << daddr.to_string();
+    if (size > sizeof(buf))
         return -1;
-    }
 
-    return len;
+    // Checksum over a zeroed checksum field, like in templates.
+    memcpy(buf, msg, size);
+    ((struct icmp6_hdr* )buf)->icmp6_cksum = 0;
+
+    return write_direct(hwdaddr, saddr, daddr, buf, size, checksum_msg(buf, size));
 }
 
-ssize_t iface::read_solicit(address& saddr, address& daddr, address& taddr)
+ssize_t iface::write_direct(const struct ether_addr& hwdaddr, const address& saddr,
+                            const address& daddr, const uint8_t* msg, size_t size, uint32_t sum)
 {
-    struct sockaddr_ll t_saddr;
-    uint8_t msg[256];
-    ssize_t len;
+    size_t len = ETH_HLEN + sizeof(struct ip6_hdr) + size;
+
+    if ((_pfd < 0) || (len > TX_BUF_SIZE))
+        return -1;
 
-    if ((len = read(_pfd, (struct sockaddr*)&t_saddr, sizeof(struct sockaddr_ll), msg, sizeof(msg))) < 0) {
-        logger::warning() << "iface::read_solicit() failed: " << logger::err();
+    NDPPD_DEBUG << "iface::write_direct() ifa=" << name() << ", daddr=" << daddr.to_string()
+                    << ", hwaddr=" << ether_ntoa(&hwdaddr) << ", len=" << (int)size;
+
+    if (_ftxq.size() >= TX_QUEUE_MAX) {
+        _tx_dropped++;
         return -1;
     }
 
+    if (_txq.empty() && _ftxq.empty())
+        _tx_pending.push_back(_ptr);
+
+    _ftxq.resize(_ftxq.size() + 1);
+
+    tx_msg& m = _ftxq.back();
+
+    // Only used to report errors.
+    memset(&m.daddr, 0, sizeof(struct sockaddr_in6));
+    m.daddr.sin6_family = AF_INET6;
+    memcpy(&m.daddr.sin6_addr, &daddr.const_addr(), sizeof(struct in6_addr));
+
+    struct ether_header* eh = (struct ether_header* )m.buf;
+    memcpy(eh->ether_dhost, &hwdaddr, ETH_ALEN);
+    memcpy(eh->ether_shost, &hwaddr, ETH_ALEN);
+    eh->ether_type = htons(ETHERTYPE_IPV6);
+
+    struct ip6_hdr* ip6h = (struct ip6_hdr* )(m.buf + ETH_HLEN);
+    memset(ip6h, 0, sizeof(struct ip6_hdr));
+    ip6h->ip6_flow = htonl(6 << 28);
+    ip6h->ip6_plen = htons(size);
+    ip6h->ip6_nxt  = IPPROTO_ICMPV6;
+    ip6h->ip6_hlim = 255;
+    memcpy(&ip6h->ip6_src, &saddr.const_addr(), sizeof(struct in6_addr));
+    memcpy(&ip6h->ip6_dst, &daddr.const_addr(), sizeof(struct in6_addr));
+
+    uint8_t* payload = m.buf + ETH_HLEN + sizeof(struct ip6_hdr);
+    memcpy(payload, msg, size);
+
+    // The kernel fills in the checksum on _ifd, but not here; msg is
+    // already summed, so only the addresses need adding.
+    sum = checksum_add(sum, (const uint8_t* )&ip6h->ip6_src, sizeof(struct in6_addr));
+    sum = checksum_add(sum, (const uint8_t* )&ip6h->ip6_dst, sizeof(struct in6_addr));
+    ((struct icmp6_hdr* )payload)->icmp6_cksum = checksum_fold(sum);
+
+    m.len = len;
+
+    _tx_direct++;
+
+    return size;
+}
+
+void iface::flush()
+{
+    flush(_ifd, _txq, true);
+    flush(_pfd, _ftxq, false);
+
+    // There's no EPOLLOUT to wait for, as it would fire for every packet
+    // sent; poll the socket again a little later instead.
+    if (!_txq.empty() || !_ftxq.empty())
+        _tx_retry.schedule(TX_RETRY);
+}
+
+void iface::retry_flush()
+{
+    _tx_pending.push_back(_ptr);
+}
+
+void iface::flush(int fd, std::vector<tx_msg>& q, bool named)
+{
+    struct mmsghdr msgs[64];
+    struct iovec iov[64];
+
+    size_t i = 0;
+
+    while ((i < q.size()) && (fd >= 0)) {
+        size_t n = 0;
+
+        while ((n < 64) && (i + n < q.size())) {
+            tx_msg& m = q[i + n];
+
+            iov[n].iov_base = m.buf;
+            iov[n].iov_len  = m.len;
+
+            memset(&msgs[n], 0, sizeof(struct mmsghdr));
+
+            // _pfd is bound to the interface, so frames need no address.
+            if (named) {
+                msgs[n].msg_hdr.msg_name    = &m.daddr;
+                msgs[n].msg_hdr.msg_namelen = sizeof(struct sockaddr_in6);
+            }
+
+            msgs[n].msg_hdr.msg_iov     = &iov[n];
+            msgs[n].msg_hdr.msg_iovlen  = 1;
+            n++;
+        }
+
+        int len;
+
+        if ((len = sendmmsg(fd, msgs, n, 0)) < 0) {
+            // Out of buffer space; keep the rest for the next flush.
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == ENOBUFS) ||
+                    (errno == EINTR))
+                break;
+
+            // Otherwise the first message failed; drop it and carry on
+            // with the rest of the queue.
+            NDPPD_DEBUG << "iface::flush() failed! error=" << logger::err() << ", ifa=" << name()
+                            << ", daddr=" << address(q[i].daddr.sin6_addr).to_string();
+            _tx_dropped++;
+            i++;
+            continue;
+        }
+
+        _tx_packets += len;
+        _tx_calls++;
+
+        i += len;
+    }
+
+    if (fd < 0) {
+        _tx_dropped += q.size();
+        q.clear();
+    } else {
+        q.erase(q.begin(), q.begin() + i);
+    }
+}
+
+void iface::flush_all()
+{
+    if (_tx_pending.empty())
+        return;
+
+    std::vector<ptr<iface> > pending;
+    pending.swap(_tx_pending);
+
+    for (std::vector<ptr<iface> >::iterator it = pending.begin();
+            it != pending.end(); it++) {
+        (*it)->flush();
+    }
+}
+
+bool iface::parse_solicit(const uint8_t* msg, size_t len, nd_packet& pkt)
+{
+    if (len < ETH_HLEN + sizeof(struct ip6_hdr) + sizeof(struct nd_neighbor_solicit)) {
+        return false;
+    }
+
     struct ip6_hdr* ip6h =
           (struct ip6_hdr* )(msg + ETH_HLEN);
 
     struct nd_neighbor_solicit*  ns =
         (struct nd_neighbor_solicit*)(msg + ETH_HLEN + sizeof(struct ip6_hdr));
 
-    taddr = ns->nd_ns_target;
-    daddr = ip6h->ip6_dst;
-    saddr = ip6h->ip6_src;
-    
+    pkt.taddr = ns->nd_ns_target;
+    pkt.daddr = ip6h->ip6_dst;
+    pkt.saddr = ip6h->ip6_src;
+
+    // Prefer the Source Link-Layer Address option over the Ethernet
+    // source, in case the frame was relayed.
+    memcpy(&pkt.lladdr, ((struct ether_header* )msg)->ether_shost, ETH_ALEN);
+    pkt.has_lladdr = true;
+
+    size_t end = ETH_HLEN + sizeof(struct ip6_hdr) + ntohs(ip6h->ip6_plen);
+
+    if (end > len)
+        end = len;
+
+    for (size_t off = ETH_HLEN + sizeof(struct ip6_hdr) + sizeof(struct nd_neighbor_solicit);
+            off + sizeof(struct nd_opt_hdr) <= end; ) {
+        const struct nd_opt_hdr* opt = (const struct nd_opt_hdr* )(msg + off);
+
+        if (!opt->nd_opt_len || (off + opt->nd_opt_len * 8 > end))
+            break;
+
+        if ((opt->nd_opt_type == ND_OPT_SOURCE_LINKADDR) && (opt->nd_opt_len == 1)) {
+            memcpy(&pkt.lladdr, msg + off + sizeof(struct nd_opt_hdr), ETH_ALEN);
+            break;
+        }
+
+        off += opt->nd_opt_len * 8;
+    }
+
     // Ignore packets sent from this machine
-    if (iface::is_local(saddr) == true) {
-        return 0;
+    if (address::is_local(pkt.saddr) == true) {
+        NDPPD_DEBUG << "iface::read_solicit() loopback received and ignored";
+        return false;
     }
 
-    logger::debug() << "iface::read_solicit() saddr=" << saddr.to_string()
-                    << ", daddr=" << daddr.to_string() << ", taddr=" << taddr.to_string() << ", len=" << len;
+    NDPPD_DEBUG << "iface::read_solicit() saddr=" << pkt.saddr.to_string()
+                    << ", daddr=" << pkt.daddr.to_string() << ", taddr=" << pkt.taddr.to_string() << ", len=" << (int)len;
 
-    return len;
+    return true;
 }
 
-ssize_t iface::write_solicit(const address& taddr)
+int iface::read_solicit(std::vector<nd_packet>& pkts)
+{
+    int n;
+
+    pkts.clear();
+
+    if ((n = read(_pfd)) <= 0) {
+        return n;
+    }
+
+    for (int i = 0; i < n; i++) {
+        nd_packet pkt;
+
+        if (parse_solicit(&_rx_buf[i * RX_BUF_SIZE], _rx_msgs[i].msg_len, pkt)) {
+            pkts.push_back(pkt);
+        }
+    }
+
+    return n;
+}
+
+bool iface::setup_ring(int fd)
+{
+    int version = TPACKET_V3;
+
+    if (setsockopt(fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0) {
+        logger::warning() << "Failed to select TPACKET_V3: " << logger::err();
+        return false;
+    }
+
+    // 16 blocks of 64 KiB; a block is handed over once it is full or
+    // has been open for 1 ms, which bounds the added latency.
+    struct tpacket_req3 req;
+    memset(&req, 0, sizeof(req));
+    req.tp_block_size       = 1 << 16;
+    req.tp_block_nr         = 16;
+    req.tp_frame_size       = 1 << 11;
+    req.tp_frame_nr         = (req.tp_block_size * req.tp_block_nr) / req.tp_frame_size;
+    req.tp_retire_blk_tov   = 1;
+    req.tp_feature_req_word = 0;
+
+    if (setsockopt(fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) < 0) {
+        logger::warning() << "Failed to set up PACKET_RX_RING: " << logger::err();
+        version = TPACKET_V1;
+        setsockopt(fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version));
+        return false;
+    }
+
+    void* ring = mmap(NULL, req.tp_block_size * req.tp_block_nr,
+                      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_LOCKED, fd, 0);
+
+    if (ring == MAP_FAILED) {
+        // MAP_LOCKED may fail because of RLIMIT_MEMLOCK; try without.
+        ring = mmap(NULL, req.tp_block_size * req.tp_block_nr,
+                    PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+
+    if (ring == MAP_FAILED) {
+        logger::warning() << "Failed to map PACKET_RX_RING: " << logger::err();
+
+        // Tear the ring down again so recvmmsg() works.
+        memset(&req, 0, sizeof(req));
+        setsockopt(fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req));
+        version = TPACKET_V1;
+        setsockopt(fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version));
+        return false;
+    }
+
+    _ring            = (uint8_t* )ring;
+    _ring_block_size = req.tp_block_size;
+    _ring_block_nr   = req.tp_block_nr;
+    _ring_block      = 0;
+
+    NDPPD_DEBUG << "iface::setup_ring() ifa=" << name() << ", blocks=" << (int)_ring_block_nr;
+
+    return true;
+}
+
+void iface::drain_ring()
 {
-    char buf[128];
+    std::vector<nd_packet> pkts;
+
+    while (_pfd >= 0) {
+        struct tpacket_block_desc* bd =
+            (struct tpacket_block_desc* )(_ring + _ring_block * _ring_block_size);
+
+        if (!(__atomic_load_n(&bd->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER))
+            break;
+
+        int n = bd->hdr.bh1.num_pkts;
 
-    memset(buf, 0, sizeof(buf));
+        // Frames are parsed right where the kernel put them.
+        struct tpacket3_hdr* ppd =
+            (struct tpacket3_hdr* )((uint8_t* )bd + bd->hdr.bh1.offset_to_first_pkt);
+
+        pkts.clear();
+
+        for (int i = 0; i < n; i++) {
+            nd_packet pkt;
+
+            if (parse_solicit((uint8_t* )ppd + ppd->tp_mac, ppd->tp_snaplen, pkt)) {
+                pkts.push_back(pkt);
+            }
+
+            ppd = (struct tpacket3_hdr* )((uint8_t* )ppd + ppd->tp_next_offset);
+        }
+
+        for (std::vector<nd_packet>::const_iterator it = pkts.begin();
+                it != pkts.end(); it++) {
+            handle_solicit(*it);
+        }
+
+        // The handlers may have closed the socket and the ring with it.
+        if (!_ring)
+            break;
+
+        __atomic_store_n(&bd->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+
+        _ring_block = (_ring_block + 1) % _ring_block_nr;
+
+        if (n > 0) {
+            _rx_packets += n;
+            _rx_calls++;
+
+            if (n > _rx_max)
+                _rx_max = n;
+        }
+    }
+}
+
+void iface::build_solicit(nd_template& t, const address& taddr)
+{
+    memset(t.msg, 0, sizeof(t.msg));
 
     struct nd_neighbor_solicit* ns =
-        (struct nd_neighbor_solicit* )&buf[0];
+        (struct nd_neighbor_solicit* )&t.msg[0];
 
     struct nd_opt_hdr* opt =
-        (struct nd_opt_hdr* )&buf[sizeof(struct nd_neighbor_solicit)];
+        (struct nd_opt_hdr* )&t.msg[sizeof(struct nd_neighbor_solicit)];
 
     opt->nd_opt_type = ND_OPT_SOURCE_LINKADDR;
     opt->nd_opt_len  = 1;
@@ -418,343 +825,665 @@ ssize_t iface::write_solicit(const address& taddr)
 
     memcpy(&ns->nd_ns_target,& taddr.const_addr(), sizeof(struct in6_addr));
 
-    memcpy(buf + sizeof(struct nd_neighbor_solicit) + sizeof(struct nd_opt_hdr),
+    memcpy(t.msg + sizeof(struct nd_neighbor_solicit) + sizeof(struct nd_opt_hdr),
            &hwaddr, 6);
 
-    // FIXME: Alright, I'm lazy.
-    static address multicast("ff02::1:ff00:0000");
-
-    address daddr;
-
-    daddr = multicast;
-
-    daddr.addr().s6_addr[13] = taddr.const_addr().s6_addr[13];
-    daddr.addr().s6_addr[14] = taddr.const_addr().s6_addr[14];
-    daddr.addr().s6_addr[15] = taddr.const_addr().s6_addr[15];
+    t.len = sizeof(struct nd_neighbor_solicit) + sizeof(struct nd_opt_hdr) + 6;
+
+    // Solicited-node multicast address, ff02::1:ffXX:XXXX.
+    struct in6_addr daddr;
+    memset(&daddr, 0, sizeof(daddr));
+    daddr.s6_addr[0]  = 0xff;
+    daddr.s6_addr[1]  = 0x02;
+    daddr.s6_addr[11] = 0x01;
+    daddr.s6_addr[12] = 0xff;
+    daddr.s6_addr[13] = taddr.const_addr().s6_addr[13];
+    daddr.s6_addr[14] = taddr.const_addr().s6_addr[14];
+    daddr.s6_addr[15] = taddr.const_addr().s6_addr[15];
+    t.daddr = daddr;
+
+    t.sum        = checksum_msg(t.msg, t.len);
+    t.generation = _generation;
+    t.router     = false;
+}
 
-    logger::debug() << "iface::write_solicit() taddr=" << taddr.to_string()
-                    << ", daddr=" << daddr.to_string();
+ssize_t iface::write_solicit(const nd_template& t)
+{
+    NDPPD_DEBUG << "iface::write_solicit() taddr="
+                    << address(((struct nd_neighbor_solicit* )t.msg)->nd_ns_target).to_string()
+                    << ", daddr=" << t.daddr.to_string();
 
-    return write(_ifd, daddr, (uint8_t* )buf, sizeof(struct nd_neighbor_solicit)
-                 + sizeof(struct nd_opt_hdr) + 6);
+    return write(t.daddr, t.msg, t.len);
 }
 
-ssize_t iface::write_advert(const address& daddr, const address& taddr, bool router)
+ssize_t iface::write_solicit(const address& taddr)
 {
-    char buf[128];
+    nd_template t;
+    build_solicit(t, taddr);
+    return write_solicit(t);
+}
 
-    memset(buf, 0, sizeof(buf));
+void iface::build_advert(nd_template& t, const address& taddr, bool router)
+{
+    memset(t.msg, 0, sizeof(t.msg));
 
     struct nd_neighbor_advert* na =
-        (struct nd_neighbor_advert* )&buf[0];
+        (struct nd_neighbor_advert* )&t.msg[0];
 
     struct nd_opt_hdr* opt =
-        (struct nd_opt_hdr* )&buf[sizeof(struct nd_neighbor_advert)];
+        (struct nd_opt_hdr* )&t.msg[sizeof(struct nd_neighbor_advert)];
 
     opt->nd_opt_type         = ND_OPT_TARGET_LINKADDR;
     opt->nd_opt_len          = 1;
 
+    // The solicited flag is cleared when the advert goes to a multicast
+    // address.
     na->nd_na_type           = ND_NEIGHBOR_ADVERT;
-    na->nd_na_flags_reserved = (daddr.is_multicast() ? 0 : ND_NA_FLAG_SOLICITED) | (router ? ND_NA_FLAG_ROUTER : 0);
+    na->nd_na_flags_reserved = ND_NA_FLAG_SOLICITED | (router ? ND_NA_FLAG_ROUTER : 0);
 
     memcpy(&na->nd_na_target,& taddr.const_addr(), sizeof(struct in6_addr));
 
-    memcpy(buf + sizeof(struct nd_neighbor_advert) + sizeof(struct nd_opt_hdr),
+    memcpy(t.msg + sizeof(struct nd_neighbor_advert) + sizeof(struct nd_opt_hdr),
            &hwaddr, 6);
 
-    logger::debug() << "iface::write_advert() daddr=" << daddr.to_string()
-                    << ", taddr=" << taddr.to_string();
+    t.len        = sizeof(struct nd_neighbor_advert) + sizeof(struct nd_opt_hdr) + 6;
+    t.sum        = checksum_msg(t.msg, t.len);
+    t.generation = _generation;
+    t.router     = router;
+}
 
-    return write(_ifd, daddr, (uint8_t* )buf, sizeof(struct nd_neighbor_advert) +
-        sizeof(struct nd_opt_hdr) + 6);
+ssize_t iface::write_advert(const nd_template& t, const address& daddr)
+{
+    NDPPD_DEBUG << "iface::write_advert() daddr=" << daddr.to_string()
+                    << ", taddr=" << address(((struct nd_neighbor_advert* )t.msg)->nd_na_target).to_string();
+
+    if (daddr.is_multicast()) {
+        uint8_t buf[nd_template::SIZE];
+        memcpy(buf, t.msg, t.len);
+        ((struct nd_neighbor_advert* )buf)->nd_na_flags_reserved &= ~ND_NA_FLAG_SOLICITED;
+        return write(daddr, buf, t.len);
+    }
+
+    // If we know where the requester is, skip the kernel's neighbor
+    // resolution (and the solicit it would send first).
+    struct ether_addr hw;
+    address saddr;
+
+    if (lookup_lladdr(daddr, hw) && source_address(saddr) &&
+            (write_direct(hw, saddr, daddr, t.msg, t.len, t.sum) >= 0))
+        return t.len;
+
+    return write(daddr, t.msg, t.len);
 }
 
-ssize_t iface::read_advert(address& saddr, address& taddr)
+ssize_t iface::write_advert(const address& daddr, const address& taddr, bool router)
 {
-    struct sockaddr_in6 t_saddr;
-    uint8_t msg[256];
-    ssize_t len;
-    
-    memset(&t_saddr, 0, sizeof(struct sockaddr_in6));
-    t_saddr.sin6_family = AF_INET6;
-    t_saddr.sin6_port   = htons(IPPROTO_ICMPV6); // Needed?
+    nd_template t;
+    build_advert(t, taddr, router);
+    return write_advert(t, daddr);
+}
 
-    if ((len = read(_ifd, (struct sockaddr* )&t_saddr, sizeof(struct sockaddr_in6), msg, sizeof(msg))) < 0) {
-        logger::warning() << "iface::read_advert() failed: " << logger::err();
-        return -1;
+bool iface::is_current(const nd_template& t) const
+{
+    return t.len && (t.generation == _generation);
+}
+
+unsigned int iface::generation() const
+{
+    return _generation;
+}
+
+iface* iface::by_ifindex(int ifindex)
+{
+    for (std::vector<iface*>::iterator it = _ids.begin(); it != _ids.end(); it++) {
+        if (*it && ((*it)->_ifindex == ifindex))
+            return *it;
     }
 
-    saddr = t_saddr.sin6_addr;
-    
-    // Ignore packets sent from this machine
-    if (iface::is_local(saddr) == true) {
-        return 0;
+    return 0;
+}
+
+void iface::update_hwaddr(int ifindex, const struct ether_addr& hw)
+{
+    iface* ifa = by_ifindex(ifindex);
+
+    if (!ifa || !memcmp(&ifa->hwaddr, &hw, sizeof(struct ether_addr)))
+        return;
+
+    logger::notice() << "Link-layer address of " << ifa->_name << " is now " << ether_ntoa(&hw);
+
+    ifa->hwaddr = hw;
+    ifa->_generation++;
+
+    // The XDP program has the address built in.
+    if (ifa->_xdp)
+        invalidate_filters();
+}
+
+void iface::learn(const address& addr, const struct ether_addr& hw)
+{
+    uint64_t now = timer::now();
+
+    ll_entry* e = _ll_cache.find(addr);
+
+    if (!e) {
+        if (_ll_cache.size() >= LL_CACHE_MAX)
+            expire_lladdrs(now);
+
+        e = &_ll_cache[addr];
     }
 
-    if (((struct icmp6_hdr* )msg)->icmp6_type != ND_NEIGHBOR_ADVERT)
-        return -1;
+    e->hw   = hw;
+    e->seen = now;
+}
 
-    taddr = ((struct nd_neighbor_solicit* )msg)->nd_ns_target;
+bool iface::lookup_lladdr(const address& addr, struct ether_addr& hw)
+{
+    ll_entry* e = _ll_cache.find(addr);
 
-    logger::debug() << "iface::read_advert() saddr=" << saddr.to_string() << ", taddr=" << taddr.to_string() << ", len=" << len;
+    if (!e || (timer::now() - e->seen > LL_CACHE_TTL))
+        return false;
 
-    return len;
+    hw = e->hw;
+    return true;
 }
 
-bool iface::is_local(const address& addr)
+void iface::expire_lladdrs(uint64_t now)
 {
-    // Check if the address is for an interface we own that is attached to
-    // one of the slave interfaces    
-    for (std::list<ptr<route> >::iterator ad = address::addresses_begin(); ad != address::addresses_end(); ad++)
-    {
-        if ((*ad)->addr() == addr)
-            return true;
+    size_t size = _ll_cache.size();
+
+    for (addr_map<ll_entry>::iterator it = _ll_cache.begin(); it != _ll_cache.end(); ++it) {
+        if (now - it.value().seen > LL_CACHE_TTL)
+            _ll_cache.erase(it);
     }
-    return false;
+
+    if (_ll_cache.size() == size)
+        _ll_cache.clear();
+}
+
+bool iface::source_address(address& out)
+{
+    if (_src.is_empty() || (_src_generation != address::generation())) {
+        _src.reset();
+        _src_generation = address::generation();
+        address::find_link_local(_ifindex, _src);
+    }
+
+    if (_src.is_empty())
+        return false;
+
+    out = _src;
+    return true;
+}
+
+int iface::read_advert(std::vector<nd_packet>& pkts)
+{
+    int n;
+
+    pkts.clear();
+
+    if ((n = read(_ifd)) <= 0) {
+        return n;
+    }
+
+    for (int i = 0; i < n; i++) {
+        const uint8_t* msg = &_rx_buf[i * RX_BUF_SIZE];
+        size_t len = _rx_msgs[i].msg_len;
+
+        if ((len < sizeof(struct nd_neighbor_advert)) ||
+            (((struct icmp6_hdr* )msg)->icmp6_type != ND_NEIGHBOR_ADVERT)) {
+            continue;
+        }
+
+        nd_packet pkt;
+        pkt.saddr = ((struct sockaddr_in6* )&_rx_names[i])->sin6_addr;
+
+        // Ignore packets sent from this machine
+        if (address::is_local(pkt.saddr) == true) {
+            NDPPD_DEBUG << "iface::read_advert() loopback received and ignored";
+            continue;
+        }
+
+        pkt.taddr = ((struct nd_neighbor_advert* )msg)->nd_na_target;
+
+        NDPPD_DEBUG << "iface::read_advert() saddr=" << pkt.saddr.to_string() << ", taddr=" << pkt.taddr.to_string() << ", len=" << (int)len;
+
+        pkts.push_back(pkt);
+    }
+
+    return n;
 }
 
 bool iface::handle_local(const address& saddr, const address& taddr)
 {
+    if (!address::is_local(taddr))
+        return false;
+
+    if (_dispatch_dirty)
+        compile_dispatch();
+
     // Check if the address is for an interface we own that is attached to
-    // one of the slave interfaces    
-    for (std::list<ptr<route> >::iterator ad = address::addresses_begin(); ad != address::addresses_end(); ad++)
-    {
-        if ((*ad)->addr() == taddr)
-        {
-            // Loop through all the serves that are using this iface to respond to NDP solicitation requests
-            for (std::list<weak_ptr<proxy> >::iterator pit = serves_begin(); pit != serves_end(); pit++) {
-                ptr<proxy> pr = (*pit);
-                if (!pr) continue;
-                
-                for (std::list<ptr<rule> >::iterator it = pr->rules_begin(); it != pr->rules_end(); it++) {
-                    ptr<rule> ru = *it;
-
-                    if (ru->daughter() && ru->daughter()->name() == (*ad)->ifname())
-                    {
-                        logger::debug() << "proxy::handle_solicit() found local taddr=" << taddr;
-                        write_advert(saddr, taddr, false);
-                        return true;
-                    }
-                }
-            }
+    // one of the slave interfaces
+    for (std::vector<iface*>::iterator it = _serve_daughters.begin(); it != _serve_daughters.end(); it++) {
+        if (address::is_local(taddr, (*it)->_ifindex)) {
+            NDPPD_DEBUG << "proxy::handle_solicit() found local taddr=" << taddr;
+            write_advert(saddr, taddr, false);
+            return true;
         }
     }
-    
+
     return false;
 }
 
-void iface::handle_reverse_advert(const address& saddr, const std::string& ifname)
+void iface::handle_reverse_advert(const address& saddr)
 {
     if (!saddr.is_unicast())
         return;
     
-    logger::debug()
+    NDPPD_DEBUG
         << "proxy::handle_reverse_advert()";
-    
-    // Loop through all the parents that forward new NDP soliciation requests to this interface
-    for (std::list<weak_ptr<proxy> >::iterator pit = parents_begin(); pit != parents_end(); pit++) {
-        ptr<proxy> parent = (*pit);
-        if (!parent || !parent->ifa()) {
-            continue;
+
+    if (_dispatch_dirty)
+        compile_dispatch();
+
+    // Setup the reverse path on any proxies that are dealing
+    // with the reverse direction (this helps improve connectivity and
+    // latency in a full duplex setup)
+    std::vector<int> idx;
+    match_parent_rules(saddr, idx);
+
+    for (std::vector<int>::iterator it = idx.begin(); it != idx.end(); it++) {
+        const parent_rule& pru = _parent_rules[*it];
+
+        NDPPD_DEBUG << " - generating artifical advertisement: " << _name;
+        pru.pr->handle_stateless_advert(saddr, saddr, _id, pru.autovia);
+    }
+}
+
+void iface::handle_pfd()
+{
+    // Keep ourselves alive even if a handler drops the last reference.
+    ptr<iface> self = _ptr;
+
+    if (_ring) {
+        drain_ring();
+        return;
+    }
+
+    std::vector<nd_packet> pkts;
+
+    while (_pfd >= 0) {
+        int n = read_solicit(pkts);
+
+        for (std::vector<nd_packet>::const_iterator it = pkts.begin();
+                it != pkts.end(); it++) {
+            handle_solicit(*it);
         }
-    
-        // Setup the reverse path on any proxies that are dealing
-        // with the reverse direction (this helps improve connectivity and
-        // latency in a full duplex setup)
-        for (std::list<ptr<rule> >::iterator it = parent->rules_begin(); it != parent->rules_end(); it++) {
-            ptr<rule> ru = *it;
-
-            if (ru->addr() == saddr &&
-                ru->daughter()->name() == ifname)
-            {
-                logger::debug() << " - generating artifical advertisement: " << ifname;
-                parent->handle_stateless_advert(saddr, saddr, ifname, ru->autovia());
-            }
+
+        // A short batch means the socket has been drained.
+        if (n < _rx_batch)
+            break;
+    }
+}
+
+void iface::handle_ifd()
+{
+    // Keep ourselves alive even if a handler drops the last reference.
+    ptr<iface> self = _ptr;
+
+    std::vector<nd_packet> pkts;
+
+    while (_ifd >= 0) {
+        int n = read_advert(pkts);
+
+        for (std::vector<nd_packet>::const_iterator it = pkts.begin();
+                it != pkts.end(); it++) {
+            handle_advert(*it);
         }
+
+        // A short batch means the socket has been drained.
+        if (n < _rx_batch)
+            break;
     }
 }
 
-void iface::fixup_pollfds()
+typedef std::vector<struct sock_filter> bpf_prog;
+
+// Offsets of the source address and the target address of a solicit,
+// from the start of the Ethernet frame.
+enum {
+    BPF_SADDR_OFF = sizeof(struct ether_header) + offsetof(struct ip6_hdr, ip6_src),
+    BPF_TADDR_OFF = sizeof(struct ether_header) + sizeof(struct ip6_hdr) +
+                    offsetof(struct nd_neighbor_solicit, nd_ns_target)
+};
+
+static struct sock_filter bpf_stmt(uint16_t code, uint32_t k)
 {
-    _pollfds.resize(_map.size()*  2);
+    struct sock_filter f = { code, 0, 0, k };
+    return f;
+}
 
-    int i = 0;
+static struct sock_filter bpf_jump(uint16_t code, uint32_t k, uint8_t jt, uint8_t jf)
+{
+    struct sock_filter f = { code, jt, jf, k };
+    return f;
+}
 
-    logger::debug() << "iface::fixup_pollfds() _map.size()=" << _map.size();
+static uint32_t bpf_word(const address& addr, int w)
+{
+    const uint8_t* p = &addr.const_addr().s6_addr[w * 4];
+    return (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
 
-    for (std::map<std::string, weak_ptr<iface> >::iterator it = _map.begin();
-            it != _map.end(); it++) {
-        _pollfds[i].fd      = it->second->_ifd;
-        _pollfds[i].events  = POLLIN;
-        _pollfds[i].revents = 0;
-        i++;
+static uint32_t bpf_mask(int plen, int w)
+{
+    int bits = plen - w * 32;
 
-        _pollfds[i].fd      = it->second->_pfd;
-        _pollfds[i].events  = POLLIN;
-        _pollfds[i].revents = 0;
-        i++;
+    if (bits >= 32)
+        return 0xffffffff;
+
+    return (bits <= 0) ? 0 : (0xffffffff << (32 - bits));
+}
+
+// Appends code that accepts the packet if the address at offset off falls
+// within one of prefixes, which all match the packet in the words before
+// w, and falls through to whatever follows otherwise. Prefixes sharing the
+// same masked word w are tested together, so the program is a compare
+// tree rather than a list.
+static void bpf_match(bpf_prog& prog, const std::vector<address>& prefixes, int off, int w)
+{
+    std::map<std::pair<uint32_t, uint32_t>, std::vector<address> > groups;
+
+    for (std::vector<address>::const_iterator it = prefixes.begin();
+            it != prefixes.end(); it++) {
+        if (it->prefix() <= w * 32) {
+            prog.push_back(bpf_stmt(BPF_RET | BPF_K, (u_int32_t)-1));
+            return;
+        }
+
+        uint32_t mask = bpf_mask(it->prefix(), w);
+        groups[std::make_pair(mask, bpf_word(*it, w) & mask)].push_back(*it);
+    }
+
+    for (std::map<std::pair<uint32_t, uint32_t>, std::vector<address> >::iterator it = groups.begin();
+            it != groups.end(); it++) {
+        bpf_prog body;
+        bpf_match(body, it->second, off, w + 1);
+
+        prog.push_back(bpf_stmt(BPF_LD | BPF_W | BPF_ABS, off + w * 4));
+
+        if (it->first.first != 0xffffffff)
+            prog.push_back(bpf_stmt(BPF_ALU | BPF_AND | BPF_K, it->first.first));
+
+        // Conditional jumps only reach 255 instructions ahead.
+        if (body.size() <= 255) {
+            prog.push_back(bpf_jump(BPF_JMP | BPF_JEQ | BPF_K, it->first.second, 0, body.size()));
+        } else {
+            prog.push_back(bpf_jump(BPF_JMP | BPF_JEQ | BPF_K, it->first.second, 1, 0));
+            prog.push_back(bpf_stmt(BPF_JMP | BPF_JA, body.size()));
+        }
+
+        prog.insert(prog.end(), body.begin(), body.end());
     }
 }
 
-void iface::cleanup()
+void iface::update_filter()
 {
-    for (std::map<std::string, weak_ptr<iface> >::iterator it = _map.begin();
-            it != _map.end(); ) {
-        std::map<std::string, weak_ptr<iface> >::iterator c_it = it++;
-        if (!c_it->second) {
-            _map.erase(c_it);
+    if (_pfd < 0)
+        return;
+
+    // Solicits are handled if the target is covered by a rule of a proxy
+    // on this interface or is a local address of one of its daughters
+    // (see handle_local()), or if the source is covered by a rule that
+    // points back at this interface (see handle_reverse_advert()).
+    std::vector<address> targets, sources;
+
+    for (std::list<weak_ptr<proxy> >::iterator pit = _serves.begin(); pit != _serves.end(); pit++) {
+        ptr<proxy> pr = (*pit);
+        if (!pr) continue;
+
+        for (std::list<ptr<rule> >::iterator it = pr->rules_begin(); it != pr->rules_end(); it++) {
+            targets.push_back((*it)->addr());
+
+            if ((*it)->daughter())
+                address::find_all((*it)->daughter()->ifindex(), targets);
+        }
+    }
+
+    for (std::list<weak_ptr<proxy> >::iterator pit = _parents.begin(); pit != _parents.end(); pit++) {
+        ptr<proxy> pr = (*pit);
+        if (!pr) continue;
+
+        for (std::list<ptr<rule> >::iterator it = pr->rules_begin(); it != pr->rules_end(); it++) {
+            if ((*it)->daughter() && ((*it)->daughter()->id() == _id))
+                sources.push_back((*it)->addr());
+        }
+    }
+
+    // The XDP program answers without telling the parents about the
+    // requester, so it's left off where they would want to know.
+    if (_xdp) {
+        address saddr;
+
+        if (!sources.empty()) {
+            NDPPD_DEBUG << "iface::update_filter() ifa=" << _name << ", no XDP on a daughter interface";
+            _xdp->unload();
+        } else if (source_address(saddr)) {
+            _xdp->load(hwaddr, saddr);
+        } else {
+            _xdp->unload();
         }
     }
+
+    bpf_prog prog;
+
+    // Bail if it's *not* an ICMPv6 NB_NEIGHBOR_SOLICIT.
+    prog.push_back(bpf_stmt(BPF_LD | BPF_H | BPF_ABS,
+        offsetof(struct ether_header, ether_type)));
+    prog.push_back(bpf_jump(BPF_JMP | BPF_JEQ | BPF_K, ETHERTYPE_IPV6, 1, 0));
+    prog.push_back(bpf_stmt(BPF_RET | BPF_K, 0));
+    prog.push_back(bpf_stmt(BPF_LD | BPF_B | BPF_ABS,
+        sizeof(struct ether_header) + offsetof(struct ip6_hdr, ip6_nxt)));
+    prog.push_back(bpf_jump(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_ICMPV6, 1, 0));
+    prog.push_back(bpf_stmt(BPF_RET | BPF_K, 0));
+    prog.push_back(bpf_stmt(BPF_LD | BPF_B | BPF_ABS,
+        sizeof(struct ether_header) + sizeof(ip6_hdr) + offsetof(struct icmp6_hdr, icmp6_type)));
+    prog.push_back(bpf_jump(BPF_JMP | BPF_JEQ | BPF_K, ND_NEIGHBOR_SOLICIT, 1, 0));
+    prog.push_back(bpf_stmt(BPF_RET | BPF_K, 0));
+
+    size_t header = prog.size();
+
+    bpf_match(prog, targets, BPF_TADDR_OFF, 0);
+    bpf_match(prog, sources, BPF_SADDR_OFF, 0);
+
+    prog.push_back(bpf_stmt(BPF_RET | BPF_K, 0));
+
+    if (prog.size() > BPF_MAXINSNS) {
+        logger::warning()
+            << "Too many rules and addresses to filter solicits on interface '" << _name
+            << "' in the kernel; passing all of them on";
+
+        prog.resize(header);
+        prog.push_back(bpf_stmt(BPF_RET | BPF_K, (u_int32_t)-1));
+    }
+
+    struct sock_fprog fprog;
+    fprog.len    = prog.size();
+    fprog.filter = &prog[0];
+
+    if (setsockopt(_pfd, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof(fprog)) < 0) {
+        logger::error() << "Failed to set filter on interface '" << _name << "': " << logger::err();
+        return;
+    }
+
+    NDPPD_DEBUG << "iface::update_filter() ifa=" << _name << ", targets=" << (int)targets.size()
+                    << ", sources=" << (int)sources.size() << ", insns=" << (int)prog.size();
 }
 
-int iface::poll_all()
+void iface::fanout(int group, int workers)
 {
-    if (_map_dirty) {
-        cleanup();
-        fixup_pollfds();
-        _map_dirty = false;
+    _fanout_group   = group;
+    _fanout_workers = workers;
+}
+
+bool iface::join_fanout(int fd, int ifindex, const std::string& name)
+{
+    // Groups are per interface; the kernel won't mix them.
+    int arg = ((_fanout_group + ifindex) & 0xffff) | (PACKET_FANOUT_CBPF << 16);
+
+    if (setsockopt(fd, SOL_PACKET, PACKET_FANOUT, &arg, sizeof(arg)) < 0) {
+        logger::error() << "Failed to join fanout group on interface '" << name << "': " << logger::err();
+        return false;
     }
 
-    if (_pollfds.size() == 0) {
-        ::sleep(1);
-        return 0;
+    // Worker ntohl(last word of the target) % workers. Unlike the socket
+    // filter, this one sees the packet from the IPv6 header on.
+    struct sock_filter prog[] = {
+        bpf_stmt(BPF_LD | BPF_W | BPF_ABS, BPF_TADDR_OFF - sizeof(struct ether_header) + 12),
+        bpf_stmt(BPF_ALU | BPF_MOD | BPF_K, _fanout_workers),
+        bpf_stmt(BPF_RET | BPF_A, 0)
+    };
+
+    struct sock_fprog fprog;
+    fprog.len    = sizeof(prog) / sizeof(prog[0]);
+    fprog.filter = prog;
+
+    if (setsockopt(fd, SOL_PACKET, PACKET_FANOUT_DATA, &fprog, sizeof(fprog)) < 0) {
+        logger::error() << "Failed to set fanout program on interface '" << name << "': " << logger::err();
+        return false;
     }
 
-    assert(_pollfds.size() == _map.size()*  2);
+    return true;
+}
+
+bool iface::open_fast_path(int mode)
+{
+    if (!(_xdp = xdp::open(_name, mode)))
+        return false;
 
-    int len;
+    invalidate_filters();
+    return true;
+}
 
-    if ((len = ::poll(&_pollfds[0], _pollfds.size(), 50)) < 0) {
-        logger::error() << "Failed to poll interfaces: " << logger::err();
-        return -1;
+const ptr<xdp>& iface::fast_path() const
+{
+    return _xdp;
+}
+
+void iface::invalidate_filters()
+{
+    _filters_dirty = true;
+}
+
+void iface::update_filters()
+{
+    if (!_filters_dirty && (_filters_generation == address::generation()))
+        return;
+
+    _filters_dirty      = false;
+    _filters_generation = address::generation();
+
+    for (std::map<std::string, weak_ptr<iface> >::iterator it = _map.begin();
+            it != _map.end(); it++) {
+        ptr<iface> ifa = it->second;
+
+        if (ifa)
+            ifa->update_filter();
     }
+}
 
-    if (len == 0) {
-        return 0;
+void iface::handle_solicit(const nd_packet& pkt)
+{
+    if (_dispatch_dirty)
+        compile_dispatch();
+
+    if (pkt.has_lladdr && pkt.saddr.is_unicast())
+        learn(pkt.saddr, pkt.lladdr);
+
+    // Process any local addresses for interfaces that we are proxying
+    if (handle_local(pkt.saddr, pkt.taddr) == true) {
+        return;
     }
 
-    std::map<std::string, weak_ptr<iface> >::iterator i_it = _map.begin();
+    // We have to handle all the parents who may be interested in
+    // the reverse path towards the one who sent this solicit.
+    // In fact, the parent need to know the source address in order
+    // to respond to NDP Solicitations
+    handle_reverse_advert(pkt.saddr);
+
+    // Loop through all the proxies that are using this iface to respond to NDP solicitation requests
+    bool handled = false;
+    for (std::vector<proxy*>::iterator pit = _serve_table.begin(); pit != _serve_table.end(); pit++) {
+        // Process the solicitation request by relating it to other
+        // interfaces or lookup up any statics routes we have configured
+        handled = true;
+        (*pit)->handle_solicit(pkt.saddr, pkt.taddr, _id);
+    }
 
-    int i = 0;
+    // If it was not handled then write an error message
+    if (handled == false) {
+        NDPPD_DEBUG << " - solicit was ignored";
+    }
+}
 
-    for (std::vector<struct pollfd>::iterator f_it = _pollfds.begin();
-            f_it != _pollfds.end(); f_it++) {
-        assert(i_it != _map.end());
+void iface::handle_advert(const nd_packet& pkt)
+{
+    if (_dispatch_dirty)
+        compile_dispatch();
 
-        if (i && !(i % 2)) {
-            i_it++;
-        }
+    // Only parents with a rule for this interface that matches are meant
+    // to receive the advert; the first such rule of each one decides.
+    std::vector<int> idx;
+    match_parent_rules(pkt.taddr, idx);
+
+    proxy* last = 0;
 
-        bool is_pfd = i++ % 2;
+    for (std::vector<int>::iterator it = idx.begin(); it != idx.end(); it++) {
+        const parent_rule& pru = _parent_rules[*it];
 
-        if (!(f_it->revents & POLLIN)) {
+        if (pru.pr == last)
             continue;
-        }
 
-        ptr<iface> ifa = i_it->second;
+        last = pru.pr;
 
-        address saddr, daddr, taddr;
-        ssize_t size;
+        // Process the NDP advertisement
+        pru.pr->handle_advert(pkt.saddr, pkt.taddr, _id, pru.autovia);
+    }
 
-        if (is_pfd) {
-            size = ifa->read_solicit(saddr, daddr, taddr);
-            if (size < 0) {
-                logger::error() << "Failed to read from interface '%s'", ifa->_name.c_str();
-                continue;
-            } 
-            if (size == 0) {
-                logger::debug() << "iface::read_solicit() loopback received and ignored";
-                continue;
-            }
-            
-            // Process any local addresses for interfaces that we are proxying
-            if (ifa->handle_local(saddr, taddr) == true) {
-                continue;
-            }
-            
-            // We have to handle all the parents who may be interested in
-            // the reverse path towards the one who sent this solicit.
-            // In fact, the parent need to know the source address in order
-            // to respond to NDP Solicitations
-            ifa->handle_reverse_advert(saddr, ifa->name());
-
-            // Loop through all the proxies that are using this iface to respond to NDP solicitation requests
-            bool handled = false;
-            for (std::list<weak_ptr<proxy> >::iterator pit = ifa->serves_begin(); pit != ifa->serves_end(); pit++) {
-                ptr<proxy> pr = (*pit);
-                if (!pr) continue;
-                
-                // Process the solicitation request by relating it to other
-                // interfaces or lookup up any statics routes we have configured
-                handled = true;
-                pr->handle_solicit(saddr, taddr, ifa->name());
-            }
-            
-            // If it was not handled then write an error message
-            if (handled == false) {
-                logger::debug() << " - solicit was ignored";
-            }
-            
-        } else {
-            size = ifa->read_advert(saddr, taddr);
-            if (size < 0) {
-                logger::error() << "Failed to read from interface '%s'", ifa->_name.c_str();
-                continue;
-            }
-            if (size == 0) {
-                logger::debug() << "iface::read_advert() loopback received and ignored";
-                continue;
-            }
-            
-            // Process the NDP advert
-            bool handled = false;
-            for (std::list<weak_ptr<proxy> >::iterator pit = ifa->parents_begin(); pit != ifa->parents_end(); pit++) {
-                ptr<proxy> pr = (*pit);
-                if (!pr || !pr->ifa()) {
-                    continue;
-                }
-                
-                // The proxy must have a rule for this interface or it is not meant to receive
-                // any notifications and thus they must be ignored
-                bool autovia = false;
-                bool is_relevant = false;
-                for (std::list<ptr<rule> >::iterator it = pr->rules_begin(); it != pr->rules_end(); it++) {
-                    ptr<rule> ru = *it;
-                    
-                    if (ru->addr() == taddr &&
-                        ru->daughter() &&
-                        ru->daughter()->name() == ifa->name())
-                    {
-                        is_relevant = true;
-                        autovia = ru->autovia();
-                        break;
-                    }
-                }
-                if (is_relevant == false) {
-                    logger::debug() << "iface::read_advert() advert is not for " << ifa->name() << "...skipping";
-                    continue;
-                }
-                
-                // Process the NDP advertisement
-                handled = true;
-                pr->handle_advert(saddr, taddr, ifa->name(), autovia);
-            }
-            
-            // If it was not handled then write an error message
-            if (handled == false) {
-                logger::debug() << " - advert was ignored";
-            }
-        }
+    // If it was not handled then write an error message
+    if (!last) {
+        NDPPD_DEBUG << " - advert was ignored";
     }
+}
 
-    return 0;
+void iface::dump_stats()
+{
+    for (std::map<std::string, weak_ptr<iface> >::iterator it = _map.begin();
+            it != _map.end(); it++) {
+        if (!it->second)
+            continue;
+
+        ptr<iface> ifa = it->second;
+
+        logger::notice()
+            << "iface " << ifa->_name
+            << ": rx_packets=" << logger::format("%llu", (unsigned long long)ifa->_rx_packets)
+            << ", rx_calls=" << logger::format("%llu", (unsigned long long)ifa->_rx_calls)
+            << ", rx_max_batch=" << ifa->_rx_max
+            << ", rx_batch=" << _rx_batch
+            << ", tx_packets=" << logger::format("%llu", (unsigned long long)ifa->_tx_packets)
+            << ", tx_calls=" << logger::format("%llu", (unsigned long long)ifa->_tx_calls)
+            << ", tx_direct=" << logger::format("%llu", (unsigned long long)ifa->_tx_direct)
+            << ", tx_dropped=" << logger::format("%llu", (unsigned long long)ifa->_tx_dropped)
+            << ", ll_cache=" << (int)ifa->_ll_cache.size();
+    }
 }
 
 int iface::allmulti(int state)
 {
     struct ifreq ifr;
 
-    logger::debug()
+    NDPPD_DEBUG
         << "iface::allmulti() state="
         << state << ", _name=\"" << _name << "\"";
 
@@ -793,7 +1522,7 @@ int iface::promiscuous(int state)
 {
     struct ifreq ifr;
 
-    logger::debug()
+    NDPPD_DEBUG
         << "iface::promiscuous() state="
         << state << ", _name=\"" << _name << "\"";
 
@@ -836,6 +1565,7 @@ const std::string& iface::name() const
 void iface::add_serves(const ptr<proxy>& pr)
 {
     _serves.push_back(pr);
+    _dispatch_dirty = true;
 }
 
 std::list<weak_ptr<proxy> >::iterator iface::serves_begin()
@@ -851,6 +1581,7 @@ std::list<weak_ptr<proxy> >::iterator iface::serves_end()
 void iface::add_parent(const ptr<proxy>& pr)
 {
     _parents.push_back(pr);
+    _dispatch_dirty = true;
 }
 
 std::list<weak_ptr<proxy> >::iterator iface::parents_begin()
@@ -863,4 +1594,88 @@ std::list<weak_ptr<proxy> >::iterator iface::parents_end()
     return _parents.end();
 }
 
+void iface::invalidate_dispatch()
+{
+    _dispatch_dirty = true;
+}
+
+void iface::compile_dispatch()
+{
+    for (std::map<std::string, weak_ptr<iface> >::iterator it = _map.begin();
+            it != _map.end(); it++) {
+        if (iface* ifa = it->second.get_pointer())
+            ifa->compile_dispatch_one();
+    }
+
+    _dispatch_dirty = false;
+}
+
+void iface::compile_dispatch_one()
+{
+    _parent_rules.clear();
+    _parent_trie.clear();
+    _serve_table.clear();
+    _serve_daughters.clear();
+
+    // A proxy is in _parents once for each of its rules on this
+    // interface; it only needs to be in the table once.
+    std::vector<proxy*> parents;
+
+    for (std::list<weak_ptr<proxy> >::iterator pit = _parents.begin(); pit != _parents.end(); pit++) {
+        proxy* pr = pit->get_pointer();
+
+        if (!pr || !pr->ifa() || (std::find(parents.begin(), parents.end(), pr) != parents.end()))
+            continue;
+
+        parents.push_back(pr);
+
+        for (std::list<ptr<rule> >::iterator it = pr->rules_begin(); it != pr->rules_end(); it++) {
+            const ptr<rule>& ru = *it;
+
+            if (ru->daughter().get_pointer() != this)
+                continue;
+
+            parent_rule pru;
+            pru.pr      = pr;
+            pru.autovia = ru->autovia();
+
+            _parent_trie.insert(ru->addr(), (int)_parent_rules.size());
+            _parent_rules.push_back(pru);
+        }
+    }
+
+    for (std::list<weak_ptr<proxy> >::iterator pit = _serves.begin(); pit != _serves.end(); pit++) {
+        proxy* pr = pit->get_pointer();
+
+        if (!pr)
+            continue;
+
+        _serve_table.push_back(pr);
+
+        for (std::list<ptr<rule> >::iterator it = pr->rules_begin(); it != pr->rules_end(); it++) {
+            iface* daughter = (*it)->daughter().get_pointer();
+
+            if (daughter && (std::find(_serve_daughters.begin(), _serve_daughters.end(), daughter) == _serve_daughters.end()))
+                _serve_daughters.push_back(daughter);
+        }
+    }
+
+    NDPPD_DEBUG << "iface::compile_dispatch() ifa=" << _name
+                << ", parent_rules=" << (int)_parent_rules.size()
+                << ", serves=" << (int)_serve_table.size();
+}
+
+void iface::match_parent_rules(const address& addr, std::vector<int>& out)
+{
+    out.clear();
+
+    if (_parent_rules.empty())
+        return;
+
+    _parent_trie.match(addr, out);
+
+    // Back into table order: by parent, then in configuration order.
+    std::sort(out.begin(), out.end());
+}
+
 NDPPD_NS_END
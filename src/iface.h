@@ -20,17 +20,66 @@
 #include <vector>
 #include <map>
 
-#include <sys/poll.h>
 #include <net/ethernet.h>
+#include <sys/socket.h>
+#include <stdint.h>
 
 #include "ndppd.h"
+#include "addr_map.h"
+#include "trie.h"
+#include "xdp.h"
+#include "timer.h"
 
 NDPPD_NS_BEGIN
 
 class session;
 class proxy;
 
-class iface {
+// A Neighbor Solicitation or Advertisement pulled off one of the sockets.
+struct nd_packet {
+    address saddr, daddr, taddr;
+
+    // Link-layer address of the sender, taken from the Source Link-Layer
+    // Address option or else the Ethernet header. Solicits only.
+    struct ether_addr lladdr;
+
+    bool has_lladdr;
+
+    nd_packet() :
+        has_lladdr(false)
+    {
+    }
+};
+
+// A Neighbor Solicitation or Advertisement prebuilt for one target by
+// iface::build_solicit() or iface::build_advert(), so that sending it
+// again only needs the destination filled in.
+struct nd_template {
+    enum { SIZE = 32 };
+
+    uint8_t msg[SIZE];
+
+    size_t len;
+
+    // Solicited-node multicast address of the target (solicits only).
+    address daddr;
+
+    // One's complement sum of msg and the constant part of the ICMPv6
+    // pseudo-header; the addresses are added when the packet is sent.
+    uint32_t sum;
+
+    // iface::generation() and router flag the template was built for.
+    unsigned int generation;
+
+    bool router;
+
+    nd_template() :
+        len(0), sum(0), generation(0), router(false)
+    {
+    }
+};
+
+class iface : public ref_counted {
 public:
 
     // Destructor.
@@ -38,34 +87,127 @@ public:
 
     static ptr<iface> open_ifd(const std::string& name);
 
-    static ptr<iface> open_pfd(const std::string& name, bool promiscuous);
+    // Opens the PF_PACKET socket. If rx_ring is set, a memory-mapped
+    // TPACKET_V3 receive ring is used for it when the kernel supports it.
+    static ptr<iface> open_pfd(const std::string& name, bool promiscuous, bool rx_ring = false);
+
+    // Receives up to rx_batch() packets from fd into the shared receive
+    // buffers. Returns the number of packets received, or -1 on error.
+    int read(int fd);
+
+    // Queues a message for daddr on the _ifd socket. Queued messages go
+    // out with a single sendmmsg() call when flush_all() is called.
+    ssize_t write(const address& daddr, const uint8_t* msg, size_t size);
+
+    // Wraps a message for daddr in IPv6 and Ethernet headers addressed
+    // to hwdaddr and queues it on the _pfd socket, bypassing neighbor
+    // resolution. Goes out together with the write() queue.
+    ssize_t write_direct(const struct ether_addr& hwdaddr, const address& saddr,
+                         const address& daddr, const uint8_t* msg, size_t size);
 
-    static int poll_all();
+    // Same as above, with sum being the checksum of msg as stored in
+    // nd_template::sum.
+    ssize_t write_direct(const struct ether_addr& hwdaddr, const address& saddr,
+                         const address& daddr, const uint8_t* msg, size_t size, uint32_t sum);
 
-    ssize_t read(int fd, struct sockaddr* saddr, ssize_t saddr_size, uint8_t* msg, size_t size);
+    // Sends everything queued by write() or write_direct() on all
+    // interfaces.
+    static void flush_all();
 
-    ssize_t write(int fd, const address& daddr, const uint8_t* msg, size_t size);
+    // Regenerates the socket filter of the _pfd socket so the kernel
+    // only passes on solicits the proxies on this interface care about,
+    // and reloads the XDP program if anything it depends on changed.
+    void update_filter();
+
+    // Sets up the XDP fast path on this interface; see xdp. The program
+    // itself is attached by update_filter().
+    bool open_fast_path(int mode);
+
+    // Returns the fast path, or NULL if there is none.
+    const ptr<xdp>& fast_path() const;
+
+    // Marks all filters out of date, e.g. after rules have changed.
+    static void invalidate_filters();
+
+    // Calls update_filter() on all interfaces if the rules or the local
+    // addresses have changed since the last time.
+    static void update_filters();
 
     // Writes a NB_NEIGHBOR_SOLICIT message to the _ifd socket.
     ssize_t write_solicit(const address& taddr);
 
-    // Writes a NB_NEIGHBOR_ADVERT message to the _ifd socket;
+    ssize_t write_solicit(const nd_template& t);
+
+    void build_solicit(nd_template& t, const address& taddr);
+
+    // Writes a NB_NEIGHBOR_ADVERT message, straight to the link-layer
+    // address of daddr if it is in the cache, or else to the _ifd socket.
     ssize_t write_advert(const address& daddr, const address& taddr, bool router);
 
-    // Reads a NB_NEIGHBOR_SOLICIT message from the _pfd socket.
-    ssize_t read_solicit(address& saddr, address& daddr, address& taddr);
+    ssize_t write_advert(const nd_template& t, const address& daddr);
+
+    void build_advert(nd_template& t, const address& taddr, bool router);
+
+    // Returns true if t was built by this interface in its current state.
+    bool is_current(const nd_template& t) const;
+
+    // Changes whenever something templates depend on, like the link-layer
+    // address, changes.
+    unsigned int generation() const;
+
+    // Called when the link-layer address of the interface ifindex changes.
+    static void update_hwaddr(int ifindex, const struct ether_addr& hw);
+
+    // Remembers that addr was last seen at the link-layer address hw.
+    void learn(const address& addr, const struct ether_addr& hw);
+
+    // Looks up the link-layer address learned for addr, if still fresh.
+    bool lookup_lladdr(const address& addr, struct ether_addr& hw);
+
+    // Reads a batch of NB_NEIGHBOR_SOLICIT messages from the _pfd socket.
+    // Returns the number of packets pulled off the socket (which may be
+    // more than the number of valid messages stored in pkts), or -1.
+    int read_solicit(std::vector<nd_packet>& pkts);
+
+    // Reads a batch of NB_NEIGHBOR_ADVERT messages from the _ifd socket.
+    int read_advert(std::vector<nd_packet>& pkts);
+
+    // Parses the Ethernet frame of a NB_NEIGHBOR_SOLICIT message into pkt.
+    // Returns false if the frame should be ignored.
+    bool parse_solicit(const uint8_t* msg, size_t len, nd_packet& pkt);
+
+    void handle_solicit(const nd_packet& pkt);
 
-    // Reads a NB_NEIGHBOR_ADVERT message from the _ifd socket;
-    ssize_t read_advert(address& saddr, address& taddr);
+    void handle_advert(const nd_packet& pkt);
     
     bool handle_local(const address& saddr, const address& taddr);
     
-    bool is_local(const address& addr);
-    
-    void handle_reverse_advert(const address& saddr, const std::string& ifname);
+    void handle_reverse_advert(const address& saddr);
 
     // Returns the name of the interface.
     const std::string& name() const;
+
+    // Small number that identifies this interface among the ones that
+    // are open, for use as an array index. Reused once it is closed.
+    int id() const
+    {
+        return _id;
+    }
+
+    // Kernel index of the interface.
+    int ifindex() const
+    {
+        return _ifindex;
+    }
+
+    // Returns the open interface with the given id or kernel index, or
+    // NULL if there is none.
+    static iface* by_id(int id)
+    {
+        return ((id >= 0) && (id < (int)_ids.size())) ? _ids[id] : 0;
+    }
+
+    static iface* by_ifindex(int ifindex);
     
     std::list<weak_ptr<proxy> >::iterator serves_begin();
     
@@ -78,20 +220,136 @@ public:
     std::list<weak_ptr<proxy> >::iterator parents_end();
     
     void add_parent(const ptr<proxy>& parent);
+
+    // Flattens the proxies and rules that packets on each interface are
+    // dispatched to into tables. Done again on the next packet after
+    // invalidate_dispatch() or a new parent or served proxy.
+    static void compile_dispatch();
+
+    static void invalidate_dispatch();
     
     static std::map<std::string, weak_ptr<iface> > _map;
 
+    // Spreads the solicits of each interface over several processes.
+    // The _pfd sockets of all workers join the same fanout group, which
+    // hands each solicit to worker target % workers, so one target
+    // always ends up with the same worker. Call before open_pfd().
+    static void fanout(int group, int workers);
+
+    // Maximum number of packets read with a single recvmmsg() call.
+    static int rx_batch();
+
+    static void rx_batch(int n);
+
+    // Logs the packet counters of all interfaces.
+    static void dump_stats();
+
 private:
 
-    static bool _map_dirty;
+    enum { RX_BUF_SIZE = 256 };
 
-    // An array of objects used with ::poll.
-    static std::vector<struct pollfd> _pollfds;
+    static int _rx_batch;
 
-    // Updates the array above.
-    static void fixup_pollfds();
+    // Receive buffers shared by all interfaces, _rx_batch of each.
+    static std::vector<struct mmsghdr> _rx_msgs;
 
-    static void cleanup();
+    static std::vector<struct iovec> _rx_iov;
+
+    static std::vector<struct sockaddr_storage> _rx_names;
+
+    static std::vector<uint8_t> _rx_buf;
+
+    static bool _filters_dirty;
+
+    // See fanout().
+    static int _fanout_group, _fanout_workers;
+
+    static bool join_fanout(int fd, int ifindex, const std::string& name);
+
+    // address::generation() the filters were generated for.
+    static unsigned int _filters_generation;
+
+    enum { TX_BUF_SIZE = 128 };
+
+    struct tx_msg {
+        struct sockaddr_in6 daddr;
+        size_t len;
+        uint8_t buf[TX_BUF_SIZE];
+    };
+
+    // Messages waiting to be sent through _ifd.
+    std::vector<tx_msg> _txq;
+
+    // Ethernet frames waiting to be sent through _pfd.
+    std::vector<tx_msg> _ftxq;
+
+    // Interfaces with a non-empty _txq.
+    static std::vector<ptr<iface> > _tx_pending;
+
+    // Queued messages beyond this are dropped, in case the socket stays
+    // full; and how long to wait before trying a full socket again.
+    enum { TX_QUEUE_MAX = 1024, TX_RETRY = 10 };
+
+    uint64_t _tx_packets, _tx_calls, _tx_direct, _tx_dropped;
+
+    // Set when the kernel had no room for part of a queue.
+    timer _tx_retry;
+
+    void retry_flush();
+
+    void flush();
+
+    void flush(int fd, std::vector<tx_msg>& q, bool named);
+
+    enum { LL_CACHE_MAX = 4096, LL_CACHE_TTL = 30000 };
+
+    struct ll_entry {
+        struct ether_addr hw;
+        uint64_t seen;
+    };
+
+    // Link-layer addresses of the nodes that sent us solicits.
+    addr_map<ll_entry> _ll_cache;
+
+    // Drops cache entries older than LL_CACHE_TTL, or all of them if
+    // none are.
+    void expire_lladdrs(uint64_t now);
+
+    // Source address for write_direct(), looked up again whenever the
+    // local addresses change.
+    address _src;
+
+    unsigned int _src_generation;
+
+    bool source_address(address& out);
+
+    ptr<xdp> _xdp;
+
+    // Memory-mapped TPACKET_V3 receive ring of _pfd, or NULL if frames
+    // are read with recvmmsg().
+    uint8_t* _ring;
+
+    unsigned int _ring_block_size, _ring_block_nr, _ring_block;
+
+    bool setup_ring(int fd);
+
+    // Hands all blocks the kernel has filled to handle_solicit() and
+    // then returns them to the kernel.
+    void drain_ring();
+
+    // Number of packets and recvmmsg() calls (or ring blocks) that
+    // returned data, and the largest batch seen so far.
+    uint64_t _rx_packets, _rx_calls;
+
+    int _rx_max;
+
+    // Called by the poller when _ifd becomes readable; drains all
+    // pending NB_NEIGHBOR_ADVERT messages.
+    void handle_ifd();
+
+    // Called by the poller when _pfd becomes readable; drains all
+    // pending NB_NEIGHBOR_SOLICIT messages.
+    void handle_pfd();
 
     // Weak pointer so this object can reference itself.
     weak_ptr<iface> _ptr;
@@ -112,14 +370,47 @@ private:
 
     // Name of this interface.
     std::string _name;
+
+    int _id, _ifindex;
+
+    // Open interfaces by id(); NULL for unused ids.
+    static std::vector<iface*> _ids;
     
     std::list<weak_ptr<proxy> > _serves;
     
     std::list<weak_ptr<proxy> > _parents;
 
+    // A rule of a parent proxy that has this interface as its daughter.
+    struct parent_rule {
+        proxy* pr;
+        bool autovia;
+    };
+
+    // The rules of all parents, grouped by parent and then in
+    // configuration order, and a prefix index into them.
+    std::vector<parent_rule> _parent_rules;
+
+    trie<int> _parent_trie;
+
+    // The proxies serving this interface, and the daughters of their
+    // rules. The proxies outlive the packet loop, so no locking needed.
+    std::vector<proxy*> _serve_table;
+
+    std::vector<iface*> _serve_daughters;
+
+    static bool _dispatch_dirty;
+
+    void compile_dispatch_one();
+
+    // Stores the indexes into _parent_rules of the rules matching addr
+    // in out, in order.
+    void match_parent_rules(const address& addr, std::vector<int>& out);
+
     // The link-layer address of this interface.
     struct ether_addr hwaddr;
 
+    unsigned int _generation;
+
     // Turns on/off ALLMULTI for this interface - returns the previous state
     // or -1 if there was an error.
     int allmulti(int state);
@@ -22,6 +22,12 @@
 #include <iostream>
 #include <sstream>
 
+#include <pthread.h>
+#include <signal.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
 #include "ndppd.h"
 #include "logger.h"
 
@@ -43,6 +49,39 @@ int logger::_max_pri = LOG_NOTICE;
 
 bool logger::_syslog = false;
 
+bool logger::_async = false;
+
+// Queue of messages for the log thread. There is one producer (the
+// daemon itself) and one consumer, so it needs no locks: the producer
+// only moves head and the consumer only moves tail.
+namespace {
+    enum {
+        RING_SIZE   = 1024, // Power of two.
+        RECORD_SIZE = 512
+    };
+
+    struct record {
+        int pri;
+        char str[RECORD_SIZE];
+    };
+
+    record ring[RING_SIZE];
+
+    unsigned ring_head, ring_tail;
+
+    // Set by the log thread before it goes to sleep on wake_fd.
+    int ring_sleeping;
+
+    int ring_stop;
+
+    // Only ever incremented, by the producer.
+    uint64_t ring_dropped;
+
+    int wake_fd = -1;
+
+    pthread_t log_thread;
+}
+
 const logger::pri_name logger::_pri_names[] = {
     { "emergency",  LOG_EMERG   },
     { "alert",      LOG_ALERT   },
@@ -156,16 +195,146 @@ void logger::flush()
     if (!_force_log && (_pri > _max_pri))
         return;
 
+    if (!_async) {
+        write(_pri, _ss.str().c_str());
+        _ss.str("");
+        return;
+    }
+
+    unsigned head = ring_head;
+
+    if ((head - __atomic_load_n(&ring_tail, __ATOMIC_ACQUIRE)) >= RING_SIZE) {
+        __atomic_add_fetch(&ring_dropped, 1, __ATOMIC_RELAXED);
+        _ss.str("");
+        return;
+    }
+
+    record& rec = ring[head & (RING_SIZE - 1)];
+    rec.pri = _pri;
+    strncpy(rec.str, _ss.str().c_str(), RECORD_SIZE - 1);
+    rec.str[RECORD_SIZE - 1] = 0;
+
+    _ss.str("");
+
+    __atomic_store_n(&ring_head, head + 1, __ATOMIC_SEQ_CST);
+
+    // Pairs with the store to ring_sleeping in async_main(): either we
+    // see it asleep, or it sees the new record before going to sleep.
+    if (__atomic_load_n(&ring_sleeping, __ATOMIC_SEQ_CST)) {
+        uint64_t one = 1;
+        ::write(wake_fd, &one, sizeof(one));
+    }
+}
+
+void logger::write(int pri, const char* str)
+{
 #ifndef DISABLE_SYSLOG
     if (_syslog) {
-        ::syslog(_pri, "(%s) %s", _pri_names[_pri].name, _ss.str().c_str());
+        ::syslog(pri, "(%s) %s", _pri_names[pri].name, str);
         return;
     }
 #endif
 
-    std::cout << "(" << _pri_names[_pri].name << ") " << _ss.str() << std::endl;
+    std::cout << "(" << _pri_names[pri].name << ") " << str << std::endl;
+}
 
-    _ss.str("");
+void* logger::async_main(void* arg)
+{
+    uint64_t reported = 0;
+
+    for (;;) {
+        unsigned tail = ring_tail;
+
+        while (tail != __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE)) {
+            record& rec = ring[tail & (RING_SIZE - 1)];
+            write(rec.pri, rec.str);
+            __atomic_store_n(&ring_tail, ++tail, __ATOMIC_RELEASE);
+        }
+
+        uint64_t dropped = __atomic_load_n(&ring_dropped, __ATOMIC_RELAXED);
+
+        if (dropped != reported) {
+            write(LOG_WARNING, format("Logging fell behind; %llu message(s) dropped",
+                (unsigned long long)(dropped - reported)).c_str());
+            reported = dropped;
+        }
+
+        if (__atomic_load_n(&ring_stop, __ATOMIC_ACQUIRE))
+            break;
+
+        __atomic_store_n(&ring_sleeping, 1, __ATOMIC_SEQ_CST);
+
+        if (tail == __atomic_load_n(&ring_head, __ATOMIC_SEQ_CST)) {
+            struct pollfd pfd;
+            pfd.fd     = wake_fd;
+            pfd.events = POLLIN;
+
+            if (poll(&pfd, 1, -1) > 0) {
+                uint64_t n;
+                read(wake_fd, &n, sizeof(n));
+            }
+        }
+
+        __atomic_store_n(&ring_sleeping, 0, __ATOMIC_RELAXED);
+    }
+
+    return 0;
+}
+
+bool logger::async(bool enable)
+{
+    if (enable == _async)
+        return true;
+
+    if (!enable) {
+        _async = false;
+
+        __atomic_store_n(&ring_stop, 1, __ATOMIC_RELEASE);
+
+        uint64_t one = 1;
+        ::write(wake_fd, &one, sizeof(one));
+
+        pthread_join(log_thread, 0);
+
+        close(wake_fd);
+        wake_fd = -1;
+        return true;
+    }
+
+    if ((wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        logger::error() << "Failed to create log eventfd: " << logger::err();
+        return false;
+    }
+
+    ring_head = ring_tail = 0;
+    ring_sleeping = ring_stop = 0;
+    ring_dropped = 0;
+
+    // Signals are for the main thread; they have to interrupt its
+    // poller::wait(), so the new thread blocks them all.
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+
+    int err = pthread_create(&log_thread, 0, async_main, 0);
+
+    pthread_sigmask(SIG_SETMASK, &old, 0);
+
+    if (err) {
+        errno = err;
+        logger::error() << "Failed to start log thread: " << logger::err();
+        close(wake_fd);
+        wake_fd = -1;
+        return false;
+    }
+
+    _async = true;
+    return true;
+}
+
+uint64_t logger::dropped()
+{
+    return __atomic_load_n(&ring_dropped, __ATOMIC_RELAXED);
 }
 
 #ifndef DISABLE_SYSLOG
@@ -17,6 +17,8 @@
 
 #include <sstream>
 
+#include <stdint.h>
+
 #ifndef DISABLE_SYSLOG
 #   include <syslog.h>
 #else
@@ -47,6 +49,15 @@ public:
 
     static void max_pri(int pri);
 
+    // Hands messages to a background thread rather than writing them
+    // out here, so that a slow syslog can't hold up the caller. Messages
+    // are dropped if it falls too far behind. Turning it off writes out
+    // whatever is still queued.
+    static bool async(bool enable);
+
+    // Number of messages dropped since async() was turned on.
+    static uint64_t dropped();
+
     void flush();
 
     static bool verbosity(const std::string& name);
@@ -55,6 +66,17 @@ public:
 
     static void verbosity(int pri);
 
+    // Whether messages of priority pri would be logged at all. Debug
+    // messages never are if built with DISABLE_DEBUG_LOG.
+    static bool enabled(int pri)
+    {
+#ifdef DISABLE_DEBUG_LOG
+        if (pri >= LOG_DEBUG)
+            return false;
+#endif
+        return pri <= _max_pri;
+    }
+
     logger& operator<<(const std::string& str);
     logger& operator<<(logger& (*pf)(logger& ));
     logger& operator<<(int n);
@@ -89,9 +111,26 @@ private:
 
     static bool _syslog;
 
+    static bool _async;
+
     static int _max_pri;
 
+    static void write(int pri, const char* str);
 
+    static void* async_main(void* arg);
 };
 
 NDPPD_NS_END
+
+// Use this rather than logger::debug(): when debug messages are disabled,
+// neither the logger nor any of the operands are evaluated, and with
+// DISABLE_DEBUG_LOG the whole statement is compiled out.
+//
+//   NDPPD_DEBUG << "session::send_solicit() taddr=" << _taddr;
+#ifdef DISABLE_DEBUG_LOG
+#   define NDPPD_DEBUG \
+    if (true) {} else ::ndppd::logger::debug()
+#else
+#   define NDPPD_DEBUG \
+    if (!::ndppd::logger::enabled(LOG_DEBUG)) {} else ::ndppd::logger::debug()
+#endif
@@ -22,17 +22,32 @@
 #include <memory>
 
 #include <getopt.h>
-#include <sys/time.h>
 
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 #include <unistd.h>
+#include <errno.h>
 
 #include "ndppd.h"
 #include "route.h"
+#include "rtnl.h"
+#include "poller.h"
+#include "timer.h"
+#include "probe.h"
 
 using namespace ndppd;
 
+enum { MAX_WORKERS = 64 };
+
+// Worker processes, if we're the parent of any.
+static pid_t workers[MAX_WORKERS];
+
+static int worker_count = 0;
+
+// Which worker we are, or -1 if there's only one process.
+static int worker_index = -1;
+
 static int daemonize()
 {
     pid_t pid = fork();
@@ -137,15 +152,10 @@ static bool configure(ptr<conf>& cf)
 {
     ptr<conf> x_cf;
 
-    if (!(x_cf = cf->find("route-ttl")))
-        route::ttl(30000);
+    if (!(x_cf = cf->find("rx-batch")))
+        iface::rx_batch(32);
     else
-        route::ttl(*x_cf);
-    
-    if (!(x_cf = cf->find("address-ttl")))
-        address::ttl(30000);
-    else
-        address::ttl(*x_cf);
+        iface::rx_batch(*x_cf);
     
     std::list<ptr<rule> > myrules;
 
@@ -166,11 +176,33 @@ static bool configure(ptr<conf>& cf)
         else
             promiscuous = *x_cf;
 
-        ptr<proxy> pr = proxy::open(*pr_cf, promiscuous);
+        bool rx_ring = false;
+        if ((x_cf = pr_cf->find("rx-ring")))
+            rx_ring = *x_cf;
+
+        ptr<proxy> pr = proxy::open(*pr_cf, promiscuous, rx_ring);
         if (!pr || pr.is_null() == true) {
             return false;
         }
 
+        if ((x_cf = pr_cf->find("xdp"))) {
+            int mode = xdp::parse_mode(*x_cf);
+
+            // Only one program can be attached, and it would only know
+            // about the sessions of one worker.
+            if ((mode >= 0) && (worker_index >= 0)) {
+                if (worker_index == 0) {
+                    logger::warning()
+                        << "XDP is not supported with more than one worker; not using it on '"
+                        << pr->ifa()->name() << "'";
+                }
+            } else if ((mode >= 0) && !pr->ifa()->open_fast_path(mode)) {
+                logger::warning()
+                    << "Failed to set up XDP on interface '" << pr->ifa()->name()
+                    << "', answering all solicits from user space";
+            }
+        }
+
         if (!(x_cf = pr_cf->find("router")))
             pr->router(true);
         else
@@ -206,6 +238,9 @@ static bool configure(ptr<conf>& cf)
         else
             pr->timeout(*x_cf);
 
+        if ((x_cf = pr_cf->find("max-sessions")))
+            pr->max_sessions(*x_cf);
+
         std::vector<ptr<conf> >::const_iterator r_it;
 
         std::vector<ptr<conf> > rules(pr_cf->find_all("rule"));
@@ -237,46 +272,50 @@ static bool configure(ptr<conf>& cf)
                 myrules.push_back(pr->add_rule(addr, false));
             }
         }
+
+        pr->compile();
     }
+
+    iface::compile_dispatch();
     
     // Print out all the topology    
     for (std::map<std::string, weak_ptr<iface> >::iterator i_it = iface::_map.begin(); i_it != iface::_map.end(); i_it++) {
         ptr<iface> ifa = i_it->second;
         
-        logger::debug() << "iface " << ifa->name() << " {";
+        NDPPD_DEBUG << "iface " << ifa->name() << " {";
         
         for (std::list<weak_ptr<proxy> >::iterator pit = ifa->serves_begin(); pit != ifa->serves_end(); pit++) {
             ptr<proxy> pr = (*pit);
             if (!pr) continue;
             
-            logger::debug() << "  " << "proxy " << logger::format("%x", pr.get_pointer()) << " {";
+            NDPPD_DEBUG << "  " << "proxy " << logger::format("%x", pr.get_pointer()) << " {";
             
              for (std::list<ptr<rule> >::iterator rit = pr->rules_begin(); rit != pr->rules_end(); rit++) {
                 ptr<rule> ru = *rit;
                 
-                logger::debug() << "    " << "rule " << logger::format("%x", ru.get_pointer()) << " {";
-                logger::debug() << "      " << "taddr " << ru->addr()<< ";";
+                NDPPD_DEBUG << "    " << "rule " << logger::format("%x", ru.get_pointer()) << " {";
+                NDPPD_DEBUG << "      " << "taddr " << ru->addr()<< ";";
                 if (ru->is_auto())
-                    logger::debug() << "      " << "auto;";
+                    NDPPD_DEBUG << "      " << "auto;";
                 else if (!ru->daughter())
-                    logger::debug() << "      " << "static;";
+                    NDPPD_DEBUG << "      " << "static;";
                 else
-                    logger::debug() << "      " << "iface " << ru->daughter()->name() << ";";
-                logger::debug() << "    }";
+                    NDPPD_DEBUG << "      " << "iface " << ru->daughter()->name() << ";";
+                NDPPD_DEBUG << "    }";
              }
             
-            logger::debug() << "  }";
+            NDPPD_DEBUG << "  }";
         }
         
-        logger::debug() << "  " << "parents {";
+        NDPPD_DEBUG << "  " << "parents {";
         for (std::list<weak_ptr<proxy> >::iterator pit = ifa->parents_begin(); pit != ifa->parents_end(); pit++) {
             ptr<proxy> pr = (*pit);
             
-            logger::debug() << "    " << "parent " << logger::format("%x", pr.get_pointer()) << ";";
+            NDPPD_DEBUG << "    " << "parent " << logger::format("%x", pr.get_pointer()) << ";";
         }
-        logger::debug() << "  }";
+        NDPPD_DEBUG << "  }";
         
-        logger::debug() << "}";
+        NDPPD_DEBUG << "}";
     }
     
     return true;
@@ -284,16 +323,153 @@ static bool configure(ptr<conf>& cf)
 
 static bool running = true;
 
+static bool stats_requested = false;
+
+static void forward_signal(int sig)
+{
+    for (int i = 0; i < worker_count; i++)
+        kill(workers[i], sig);
+}
+
+// Only flags the loop to stop; run() logs the shutdown, since the
+// logger isn't safe to use from a signal handler.
 static void exit_ndppd(int sig)
 {
-    logger::error() << "Shutting down...";
     running = 0;
+    forward_signal(sig);
+}
+
+static void request_stats(int sig)
+{
+    stats_requested = true;
+    forward_signal(sig);
+}
+
+static void dump_stats()
+{
+    if (worker_index >= 0)
+        logger::notice() << "worker " << worker_index << " (pid " << (int)getpid() << "):";
+
+    iface::dump_stats();
+    proxy::dump_stats();
+    session::dump_stats();
+    probe::dump_stats();
+
+    logger::notice() << "log: dropped=" << logger::format("%llu", (unsigned long long)logger::dropped());
+}
+
+static int run()
+{
+    if (!rtnl::watch_addresses() || !rtnl::watch_links())
+        return -1;
+
+    if (rule::any_auto() && !rtnl::watch_routes())
+        return -1;
+
+    // Keep syslog() and the console off the packet path from here on.
+    logger::async(true);
+
+    while (running) {
+        // Picks up rule and local address changes from the last round.
+        iface::update_filters();
+
+        if (poller::wait(timer::next_timeout()) < 0) {
+            if (running) {
+                logger::error() << "poller::wait() failed";
+            }
+            break;
+        }
+
+        if (stats_requested) {
+            stats_requested = false;
+            dump_stats();
+        }
+
+        timer::run();
+
+        // Everything generated during this iteration goes out in one go.
+        iface::flush_all();
+    }
+
+    if (!running)
+        logger::error() << "Shutting down...";
+
+    logger::async(false);
+
+    return 0;
+}
+
+// Forks count workers that each set up their own sockets and sessions
+// from cf, and waits for them. Returns in the workers as well, with
+// the result of run().
+static int run_workers(ptr<conf>& cf, int count)
+{
+    // The fanout groups are picked from our pid so that the workers
+    // agree on them.
+    iface::fanout(getpid(), count);
+
+    for (int i = 0; i < count; i++) {
+        pid_t pid = fork();
+
+        if (pid < 0) {
+            logger::error() << "Failed to fork worker: " << logger::err();
+            exit_ndppd(SIGTERM);
+            break;
+        }
+
+        if (pid == 0) {
+            worker_count = 0;
+            worker_index = i;
+
+            if (!configure(cf))
+                return -1;
+
+            return run();
+        }
+
+        workers[worker_count++] = pid;
+    }
+
+    logger::notice() << "Started " << worker_count << " workers";
+
+    int rc = 0;
+
+    while (worker_count > 0) {
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+
+        if (pid < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        for (int i = 0; i < worker_count; i++) {
+            if (workers[i] == pid) {
+                workers[i] = workers[--worker_count];
+                break;
+            }
+        }
+
+        // The workers only share the load; don't carry on without one.
+        if (running) {
+            logger::error() << "Worker " << (int)pid << " exited unexpectedly";
+            exit_ndppd(SIGTERM);
+            rc = -1;
+        }
+    }
+
+    if (!running)
+        logger::error() << "Shutting down...";
+
+    return rc;
 }
 
 int main(int argc, char* argv[], char* env[])
 {
     signal(SIGINT, exit_ndppd);
     signal(SIGTERM, exit_ndppd);
+    signal(SIGUSR1, request_stats);
 
     std::string config_path("/etc/ndppd.conf");
     std::string pidfile;
@@ -351,7 +527,20 @@ int main(int argc, char* argv[], char* env[])
     if (cf.is_null())
         return -1;
 
-    if (!configure(cf))
+    int count = 1;
+
+    ptr<conf> x_cf;
+
+    if ((x_cf = cf->find("workers")))
+        count = *x_cf;
+
+    if ((count < 1) || (count > MAX_WORKERS)) {
+        logger::error() << "'workers' must be between 1 and " << (int)MAX_WORKERS;
+        return -1;
+    }
+
+    // With workers, each of them configures itself after the fork.
+    if ((count == 1) && !configure(cf))
         return -1;
 
     if (daemon) {
@@ -368,46 +557,10 @@ int main(int argc, char* argv[], char* env[])
         pf.close();
     }
 
-    // Time stuff.
-
-    struct timeval t1, t2;
-
-    gettimeofday(&t1, 0);
+    int rc = (count > 1) ? run_workers(cf, count) : run();
 
-#ifdef WITH_ND_NETLINK
-    netlink_setup();
-#endif
-
-    while (running) {
-        if (iface::poll_all() < 0) {
-            if (running) {
-                logger::error() << "iface::poll_all() failed";
-            }
-            break;
-        }
-
-        int elapsed_time;
-        gettimeofday(&t2, 0);
-
-        elapsed_time =
-            ((t2.tv_sec  - t1.tv_sec)*   1000) +
-            ((t2.tv_usec - t1.tv_usec) / 1000);
-
-        t1.tv_sec  = t2.tv_sec;
-        t1.tv_usec = t2.tv_usec;
-
-        if (rule::any_auto())
-            route::update(elapsed_time);
-        
-        if (rule::any_iface())
-            address::update(elapsed_time);
-
-        session::update_all(elapsed_time);
-    }
-
-#ifdef WITH_ND_NETLINK
-    netlink_teardown();
-#endif
+    if (rc < 0)
+        return -1;
 
     logger::notice() << "Bye";
 
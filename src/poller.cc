@@ -0,0 +1,126 @@
+// ndppd - NDP Proxy Daemon
+// Copyright (C) 2011  Daniel Adolfsson <daniel@priv.nu>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#include <cstring>
+
+#include <unistd.h>
+#include <errno.h>
+#include <sys/epoll.h>
+
+#include "ndppd.h"
+#include "poller.h"
+
+NDPPD_NS_BEGIN
+
+int poller::_epfd = -1;
+
+std::map<int, poller::watch*>& poller::_watches = *new std::map<int, poller::watch*>();
+
+std::vector<poller::watch*>& poller::_garbage = *new std::vector<poller::watch*>();
+
+bool poller::open()
+{
+    if (_epfd >= 0)
+        return true;
+
+    if ((_epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        logger::error() << "Failed to create epoll instance: " << logger::err();
+        return false;
+    }
+
+    return true;
+}
+
+bool poller::add(int fd, handler fn, void* obj)
+{
+    if (!open())
+        return false;
+
+    remove(fd);
+
+    watch* w = new watch();
+    w->fd   = fd;
+    w->fn   = fn;
+    w->obj  = obj;
+    w->dead = false;
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events   = EPOLLIN | EPOLLET;
+    ev.data.ptr = w;
+
+    if (epoll_ctl(_epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        logger::error() << "Failed to register fd=" << fd << " with epoll: " << logger::err();
+        delete w;
+        return false;
+    }
+
+    _watches[fd] = w;
+
+    NDPPD_DEBUG << "poller::add() fd=" << fd;
+
+    return true;
+}
+
+void poller::remove(int fd)
+{
+    std::map<int, watch*>::iterator it = _watches.find(fd);
+
+    if (it == _watches.end())
+        return;
+
+    epoll_ctl(_epfd, EPOLL_CTL_DEL, fd, NULL);
+
+    it->second->dead = true;
+    _garbage.push_back(it->second);
+    _watches.erase(it);
+
+    NDPPD_DEBUG << "poller::remove() fd=" << fd;
+}
+
+int poller::wait(int timeout)
+{
+    if (!open())
+        return -1;
+
+    struct epoll_event events[64];
+    int n;
+
+    if ((n = epoll_wait(_epfd, events, 64, timeout)) < 0) {
+        if (errno == EINTR)
+            return 0;
+
+        logger::error() << "Failed to poll interfaces: " << logger::err();
+        return -1;
+    }
+
+    for (int i = 0; i < n; i++) {
+        watch* w = (watch*)events[i].data.ptr;
+
+        if (!w->dead)
+            w->fn(w->obj);
+    }
+
+    for (std::vector<watch*>::iterator it = _garbage.begin();
+            it != _garbage.end(); it++) {
+        delete *it;
+    }
+
+    _garbage.clear();
+
+    return n;
+}
+
+NDPPD_NS_END
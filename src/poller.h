@@ -0,0 +1,76 @@
+// ndppd - NDP Proxy Daemon
+// Copyright (C) 2011  Daniel Adolfsson <daniel@priv.nu>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#pragma once
+
+#include <map>
+#include <vector>
+
+#include "ndppd.h"
+
+NDPPD_NS_BEGIN
+
+// Edge-triggered epoll reactor. Every file descriptor is registered once,
+// together with the object and member function that should handle it;
+// handlers must drain their descriptor until it returns EAGAIN.
+class poller {
+public:
+    typedef void (*handler)(void* obj);
+
+    // Registers fd with a plain callback.
+    static bool add(int fd, handler fn, void* obj);
+
+    // Registers fd with a member function bound to obj.
+    template <class T, void (T::*M)()>
+    static bool add(int fd, T* obj)
+    {
+        return add(fd, &invoke<T, M>, obj);
+    }
+
+    // Unregisters fd. Safe to call from within a handler.
+    static void remove(int fd);
+
+    // Waits at most timeout milliseconds (-1 = forever) and dispatches
+    // the handlers of all ready descriptors. Returns -1 on failure.
+    static int wait(int timeout);
+
+private:
+    struct watch {
+        int fd;
+        handler fn;
+        void* obj;
+        bool dead;
+    };
+
+    static int _epfd;
+
+    // Never freed, so that objects destroyed on exit can still remove
+    // their descriptors.
+    static std::map<int, watch*>& _watches;
+
+    // Watches removed during dispatch; freed once the batch is done.
+    // Never freed itself, for the same reason as _watches.
+    static std::vector<watch*>& _garbage;
+
+    static bool open();
+
+    template <class T, void (T::*M)()>
+    static void invoke(void* obj)
+    {
+        (static_cast<T*>(obj)->*M)();
+    }
+};
+
+NDPPD_NS_END
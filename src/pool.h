@@ -0,0 +1,194 @@
+// ndppd - NDP Proxy Daemon
+// Copyright (C) 2011  Daniel Adolfsson <daniel@priv.nu>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#pragma once
+
+#include <new>
+#include <cstdlib>
+#include <stdint.h>
+
+NDPPD_NS_BEGIN
+
+// Allocator for objects of type T that come and go all the time. Memory
+// is taken from the heap a slab of SLAB_SIZE objects at a time and kept;
+// freed objects go on a free list and are handed out again first, so
+// churn doesn't fragment the heap.
+template <typename T>
+class pool {
+public:
+    enum { SLAB_SIZE = 64 };
+
+    pool() :
+        _free(0), _slabs(0), _used(0)
+    {
+    }
+
+    void* alloc()
+    {
+        if (!_free)
+            grow();
+
+        node* n = _free;
+        _free   = n->next;
+        _used++;
+        return n;
+    }
+
+    void free(void* p)
+    {
+        if (!p)
+            return;
+
+        node* n = static_cast<node* >(p);
+        n->next = _free;
+        _free   = n;
+        _used--;
+    }
+
+    // Number of objects currently allocated.
+    size_t used() const
+    {
+        return _used;
+    }
+
+    // Number of objects there is room for without growing.
+    size_t capacity() const
+    {
+        return _slabs * SLAB_SIZE;
+    }
+
+    // Bytes taken from the heap.
+    size_t bytes() const
+    {
+        return _slabs * sizeof(slab);
+    }
+
+private:
+    union node {
+        node* next;
+        char data[sizeof(T)];
+
+        // For alignment.
+        uint64_t u;
+        double d;
+        void* p;
+    };
+
+    // Slabs aren't tracked; see grow().
+    struct slab {
+        node nodes[SLAB_SIZE];
+    };
+
+    node* _free;
+
+    size_t _slabs, _used;
+
+    // Slabs are never returned; objects may live until exit.
+    void grow()
+    {
+        slab* s = static_cast<slab* >(malloc(sizeof(slab)));
+
+        if (!s)
+            throw std::bad_alloc();
+
+        for (int i = SLAB_SIZE - 1; i >= 0; i--) {
+            s->nodes[i].next = _free;
+            _free = &s->nodes[i];
+        }
+
+        _slabs++;
+    }
+};
+
+// A vector that keeps the first N elements inside itself and only goes
+// to the heap beyond that. T must be default constructible and
+// assignable.
+template <typename T, int N>
+class small_vector {
+public:
+    typedef T* iterator;
+
+    small_vector() :
+        _data(_inline), _size(0), _capacity(N)
+    {
+    }
+
+    ~small_vector()
+    {
+        if (_data != _inline)
+            delete[] _data;
+    }
+
+    iterator begin()
+    {
+        return _data;
+    }
+
+    iterator end()
+    {
+        return _data + _size;
+    }
+
+    size_t size() const
+    {
+        return _size;
+    }
+
+    bool empty() const
+    {
+        return !_size;
+    }
+
+    void push_back(const T& value)
+    {
+        if (_size == _capacity)
+            grow();
+
+        _data[_size++] = value;
+    }
+
+    // Keeps the memory; only the elements go.
+    void clear()
+    {
+        _size = 0;
+    }
+
+private:
+    T* _data;
+
+    size_t _size, _capacity;
+
+    T _inline[N];
+
+    void grow()
+    {
+        T* data = new T[_capacity * 2];
+
+        for (size_t i = 0; i < _size; i++)
+            data[i] = _data[i];
+
+        if (_data != _inline)
+            delete[] _data;
+
+        _data      = data;
+        _capacity *= 2;
+    }
+
+    small_vector(const small_vector&);
+
+    small_vector& operator=(const small_vector&);
+};
+
+NDPPD_NS_END
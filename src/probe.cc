@@ -0,0 +1,110 @@
+// ndppd - NDP Proxy Daemon
+// Copyright (C) 2011  Daniel Adolfsson <daniel@priv.nu>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#include <vector>
+
+#include "ndppd.h"
+#include "iface.h"
+#include "timer.h"
+#include "addr_map.h"
+#include "probe.h"
+
+NDPPD_NS_BEGIN
+
+// Open probes by target, indexed by iface::id(). Never freed, so that
+// sessions destroyed on exit can still close their probes.
+static std::vector<addr_map<probe* >* >& probes = *new std::vector<addr_map<probe* >* >();
+
+static int probe_count;
+
+static uint64_t probe_sent, probe_suppressed;
+
+probe::probe() :
+    _sent_at(0)
+{
+}
+
+probe::~probe()
+{
+    probes[_ifa->id()]->erase(_taddr);
+    probe_count--;
+}
+
+ptr<probe> probe::open(const ptr<iface>& ifa, const address& taddr)
+{
+    int id = ifa->id();
+
+    if (id >= (int)probes.size())
+        probes.resize(id + 1, 0);
+
+    if (!probes[id])
+        probes[id] = new addr_map<probe* >();
+
+    probe** p = probes[id]->find(taddr);
+
+    if (p)
+        return *p;
+
+    ptr<probe> pb(new probe());
+
+    pb->_ifa   = ifa;
+    pb->_taddr = taddr;
+
+    probes[id]->insert(taddr, pb.get_pointer());
+    probe_count++;
+
+    return pb;
+}
+
+bool probe::send(int interval)
+{
+    uint64_t now = timer::now();
+
+    if (_sent_at && (now - _sent_at) < (uint64_t)interval) {
+        NDPPD_DEBUG << "probe::send() taddr=" << _taddr << ", ifa=" << _ifa->name()
+            << ": already sent " << (int)(now - _sent_at) << " ms ago";
+        probe_suppressed++;
+        return false;
+    }
+
+    if (!_ifa->is_current(_solicit))
+        _ifa->build_solicit(_solicit, _taddr);
+
+    _ifa->write_solicit(_solicit);
+
+    _sent_at = now;
+    probe_sent++;
+    return true;
+}
+
+const ptr<iface>& probe::ifa() const
+{
+    return _ifa;
+}
+
+const address& probe::taddr() const
+{
+    return _taddr;
+}
+
+void probe::dump_stats()
+{
+    logger::notice()
+        << "probes: open=" << probe_count
+        << ", sent=" << logger::format("%llu", (unsigned long long)probe_sent)
+        << ", suppressed=" << logger::format("%llu", (unsigned long long)probe_suppressed);
+}
+
+NDPPD_NS_END
@@ -0,0 +1,60 @@
+// ndppd - NDP Proxy Daemon
+// Copyright (C) 2011  Daniel Adolfsson <daniel@priv.nu>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#pragma once
+
+#include <stdint.h>
+
+#include "ndppd.h"
+
+NDPPD_NS_BEGIN
+
+// The solicit for one target on one daughter interface. When several
+// proxies have rules pointing at the same daughter, each one has a
+// session for the target, but they all share this probe; so only one
+// solicit goes out per retry, and the advert that comes back reaches
+// every proxy through the interface's dispatch table anyway.
+class probe : public ref_counted {
+public:
+    // Returns the probe for taddr on ifa, creating it if there is none.
+    static ptr<probe> open(const ptr<iface>& ifa, const address& taddr);
+
+    // Destructor.
+    ~probe();
+
+    // Sends the solicit unless one went out less than interval
+    // milliseconds ago. Returns true if it was sent.
+    bool send(int interval);
+
+    const ptr<iface>& ifa() const;
+
+    const address& taddr() const;
+
+    static void dump_stats();
+
+private:
+    ptr<iface> _ifa;
+
+    address _taddr;
+
+    nd_template _solicit;
+
+    // timer::now() of the last solicit, or 0.
+    uint64_t _sent_at;
+
+    probe();
+};
+
+NDPPD_NS_END
@@ -17,6 +17,8 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <algorithm>
+
 #include "ndppd.h"
 
 #include "proxy.h"
@@ -32,32 +34,30 @@ static address all_nodes = address("ff02::1");
 std::list<ptr<proxy> > proxy::_list;
 
 proxy::proxy() :
+    _compiled(false), _max_sessions(0), _evictions(0), _miss_generation(0), _miss_hits(0),
     _router(true), _ttl(30000), _deadtime(3000), _timeout(500), _autowire(false), _keepalive(true), _promiscuous(false), _retries(3)
 {
+    for (int i = 0; i < LRU_COUNT; i++)
+        _lru[i].head = _lru[i].tail = 0;
+
+    clear_misses();
 }
 
-ptr<proxy> proxy::find_aunt(const std::string& ifname, const address& taddr)
+ptr<proxy> proxy::find_aunt(int ifid, const address& taddr)
 {
     for (std::list<ptr<proxy> >::iterator sit = _list.begin();
             sit != _list.end(); sit++)
     {
-        ptr<proxy> pr = (*sit);
-        
-        bool has_addr = false;
-        for (std::list<ptr<rule> >::iterator it = pr->_rules.begin(); it != pr->_rules.end(); it++) {
-            ptr<rule> ru = *it;
-            
-            if (ru->addr() == taddr) {
-                has_addr = true;
-                break;
-            }
-        }
-        
-        if (has_addr == false) {
+        const ptr<proxy>& pr = (*sit);
+
+        std::vector<rule*> rules;
+        pr->find_rules(taddr, rules);
+
+        if (rules.empty()) {
             continue;
         }
         
-        if (pr->ifa() && pr->ifa()->name() == ifname)
+        if (pr->ifa() && (pr->ifa()->id() == ifid))
             return pr;
     }
     
@@ -75,14 +75,14 @@ ptr<proxy> proxy::create(const ptr<iface>& ifa, bool promiscuous)
 
     ifa->add_serves(pr);
 
-    logger::debug() << "proxy::create() if=" << ifa->name();
+    NDPPD_DEBUG << "proxy::create() if=" << ifa->name();
 
     return pr;
 }
 
-ptr<proxy> proxy::open(const std::string& ifname, bool promiscuous)
+ptr<proxy> proxy::open(const std::string& ifname, bool promiscuous, bool rx_ring)
 {
-    ptr<iface> ifa = iface::open_pfd(ifname, promiscuous);
+    ptr<iface> ifa = iface::open_pfd(ifname, promiscuous, rx_ring);
 
     if (!ifa) {
         return ptr<proxy>();
@@ -93,103 +93,115 @@ ptr<proxy> proxy::open(const std::string& ifname, bool promiscuous)
 
 ptr<session> proxy::find_or_create_session(const address& taddr)
 {
-    // Let's check this proxy's list of sessions to see if we can
-    // find one with the same target address.
+    // Let's check this proxy's sessions to see if we can find one
+    // with the same target address.
 
-    for (std::list<ptr<session> >::iterator sit = _sessions.begin();
-            sit != _sessions.end(); sit++) {
-        
-        if ((*sit)->taddr() == taddr)
-            return (*sit);
+    ptr<session>* sp = _sessions.find(taddr);
+
+    if (sp) {
+        touch_session(sp->get_pointer());
+        return *sp;
     }
     
     ptr<session> se;
+
+    if (is_miss(taddr))
+        return se;
     
     // Since we couldn't find a session that matched, we'll try to find
     // a matching rule instead, and then set up a new session.
-    
-    for (std::list<ptr<rule> >::iterator it = _rules.begin();
-            it != _rules.end(); it++) {
-        ptr<rule> ru = *it;
 
-        logger::debug() << "checking " << ru->addr() << " against " << taddr;
+    std::vector<rule*> rules;
+    find_rules(taddr, rules);
 
-        if (ru->addr() == taddr) {
-            if (!se) {
-                se = session::create(_ptr, taddr, _autowire, _keepalive, _retries);
-            }
-            
-            if (ru->is_auto()) {
-                ptr<route> rt = route::find(taddr);
+    NDPPD_DEBUG << "found " << (int)rules.size() << " rule(s) matching " << taddr;
 
-                if (rt->ifname() == _ifa->name()) {
-                    logger::debug() << "skipping route since it's using interface " << rt->ifname();
-                } else {
-                    ptr<iface> ifa = rt->ifa();
+    if (rules.empty()) {
+        add_miss(taddr);
+        return se;
+    }
 
-                    if (ifa && (ifa != ru->daughter())) {
-                        se->add_iface(ifa);
-                    }
-                }
-            } else if (!ru->daughter()) {
-                // This rule doesn't have an interface, and thus we'll consider
-                // it "static" and immediately send the response.
-                se->handle_advert();
-                return se;
-                
+    for (std::vector<rule*>::iterator it = rules.begin();
+            it != rules.end(); it++) {
+        rule* ru = *it;
+
+        if (!se) {
+            se = session::create(_ptr, taddr, _autowire, _keepalive, _retries);
+        }
+        
+        if (ru->is_auto()) {
+            ptr<route> rt = route::find(taddr);
+
+            if (!rt) {
+                NDPPD_DEBUG << "no route to " << taddr;
+            } else if (rt->ifindex() == _ifa->ifindex()) {
+                NDPPD_DEBUG << "skipping route since it's using interface " << _ifa->name();
             } else {
-                
-                ptr<iface> ifa = ru->daughter();
-                se->add_iface(ifa);
-     
-                #ifdef WITH_ND_NETLINK
-                if (if_addr_find(ifa->name(), &taddr.const_addr())) {
-                    logger::debug() << "Sending NA out " << ifa->name();
-                    se->add_iface(_ifa);
-                    se->handle_advert();
+                ptr<iface> ifa = rt->ifa();
+
+                if (ifa && (ifa != ru->daughter())) {
+                    se->add_iface(ifa);
                 }
-                #endif
+            }
+        } else if (!ru->daughter()) {
+            // This rule doesn't have an interface, and thus we'll consider
+            // it "static" and immediately send the response.
+            se->handle_advert();
+            return se;
+            
+        } else {
+            
+            const ptr<iface>& ifa = ru->daughter();
+            se->add_iface(ifa);
+
+            if (address::is_local(taddr, ifa->ifindex())) {
+                NDPPD_DEBUG << "Sending NA out " << ifa->name();
+                se->add_iface(_ifa);
+                se->handle_advert();
             }
         }
     }
     
     if (se) {
-        _sessions.push_back(se);
+        if (_max_sessions && ((int)_sessions.size() >= _max_sessions))
+            evict_session();
+
+        _sessions.insert(taddr, se);
+        touch_session(se.get_pointer());
     }
     
     return se;
 }
 
-void proxy::handle_advert(const address& saddr, const address& taddr, const std::string& ifname, bool use_via)
+void proxy::handle_advert(const address& saddr, const address& taddr, int ifid, bool use_via)
 {
     // If a session exists then process the advert in the context of the session
-    for (std::list<ptr<session> >::iterator s_it = _sessions.begin();
-            s_it != _sessions.end(); s_it++)
-    {
-        const ptr<session> sess = *s_it;
+    ptr<session>* sp = _sessions.find(taddr);
 
-        if ((sess->taddr() == taddr)) {
-            sess->handle_advert(saddr, ifname, use_via);
-        }
+    if (sp) {
+        (*sp)->handle_advert(saddr, ifid, use_via);
+
+        // It may have been confirmed just now.
+        touch_session(sp->get_pointer());
     }
 }
 
-void proxy::handle_stateless_advert(const address& saddr, const address& taddr, const std::string& ifname, bool use_via)
+void proxy::handle_stateless_advert(const address& saddr, const address& taddr, int ifid, bool use_via)
 {
-    logger::debug()
-        << "proxy::handle_stateless_advert() proxy=" << (ifa() ? ifa()->name() : "null") << ", taddr=" << taddr.to_string() << ", ifname=" << ifname;
+    NDPPD_DEBUG
+        << "proxy::handle_stateless_advert() proxy=" << (ifa() ? ifa()->name() : "null") << ", taddr=" << taddr.to_string() << ", ifid=" << ifid;
     
     ptr<session> se = find_or_create_session(taddr);
     if (!se) return;
     
     if (_autowire == true && se->status() == session::WAITING) {
-        se->handle_auto_wire(saddr, ifname, use_via);
+        se->handle_auto_wire(saddr, ifid, use_via);
     }
 }
 
-void proxy::handle_solicit(const address& saddr, const address& taddr, const std::string& ifname)
+void proxy::handle_solicit(const address& saddr, const address& taddr, int ifid)
 {
-    logger::debug()
+    NDPPD_DEBUG
         << "proxy::handle_solicit()";
     
     // Otherwise find or create a session to scan for this address
@@ -222,6 +234,7 @@ ptr<rule> proxy::add_rule(const address& addr, const ptr<iface>& ifa, bool autov
     ptr<rule> ru(rule::create(_ptr, addr, ifa));
     ru->autovia(autovia);
     _rules.push_back(ru);
+    _compiled = false;
     return ru;
 }
 
@@ -229,6 +242,7 @@ ptr<rule> proxy::add_rule(const address& addr, bool aut)
 {
     ptr<rule> ru(rule::create(_ptr, addr, aut));
     _rules.push_back(ru);
+    _compiled = false;
     return ru;
 }
 
@@ -242,9 +256,164 @@ std::list<ptr<rule> >::iterator proxy::rules_end()
     return _rules.end();
 }
 
+void proxy::compile()
+{
+    _rule_vec.assign(_rules.begin(), _rules.end());
+    _rule_trie.clear();
+
+    for (size_t i = 0; i < _rule_vec.size(); i++) {
+        _rule_trie.insert(_rule_vec[i]->addr(), (int)i);
+    }
+
+    _compiled = true;
+
+    clear_misses();
+
+    // The solicit filters and dispatch tables are derived from the rules.
+    iface::invalidate_filters();
+    iface::invalidate_dispatch();
+
+    NDPPD_DEBUG << "proxy::compile() proxy=" << (_ifa ? _ifa->name() : "null")
+                    << ", rules=" << (int)_rule_vec.size();
+}
+
+void proxy::find_rules(const address& addr, std::vector<rule*>& out)
+{
+    if (!_compiled)
+        compile();
+
+    std::vector<int> idx;
+    _rule_trie.match(addr, idx);
+
+    // The trie hands matches back from the shortest prefix to the
+    // longest; put them back into configuration order.
+    std::sort(idx.begin(), idx.end());
+
+    out.clear();
+
+    for (std::vector<int>::iterator it = idx.begin(); it != idx.end(); it++) {
+        out.push_back(_rule_vec[*it]);
+    }
+}
+
+bool proxy::is_miss(const address& addr)
+{
+    // Rules or routes have changed since.
+    if (!_compiled || (_miss_generation != route::generation())) {
+        clear_misses();
+        return false;
+    }
+
+    miss& m = _misses[addr.hash() & (MISS_SIZE - 1)];
+
+    if (!m.expires || (m.addr != addr) || (m.expires <= timer::now()))
+        return false;
+
+    _miss_hits++;
+    return true;
+}
+
+void proxy::add_miss(const address& addr)
+{
+    miss& m = _misses[addr.hash() & (MISS_SIZE - 1)];
+    m.addr    = addr;
+    m.expires = timer::now() + _deadtime;
+}
+
+void proxy::clear_misses()
+{
+    for (int i = 0; i < MISS_SIZE; i++)
+        _misses[i].expires = 0;
+
+    _miss_generation = route::generation();
+}
+
 void proxy::remove_session(const ptr<session>& se)
 {
-    _sessions.remove(se);
+    ptr<session>* sp = _sessions.find(se->taddr());
+
+    if (sp && (*sp == se)) {
+        unlink_session(se.get_pointer());
+        _sessions.erase(se->taddr());
+    }
+}
+
+void proxy::touch_session(session* se)
+{
+    int lru = ((se->status() == session::VALID) || (se->status() == session::RENEWING)) ?
+        LRU_CONFIRMED : LRU_UNCONFIRMED;
+
+    if ((se->_lru == lru) && !se->_lru_next)
+        return;
+
+    unlink_session(se);
+
+    session_list& l = _lru[lru];
+
+    se->_lru      = lru;
+    se->_lru_prev = l.tail;
+    se->_lru_next = 0;
+
+    if (l.tail)
+        l.tail->_lru_next = se;
+    else
+        l.head = se;
+
+    l.tail = se;
+}
+
+void proxy::unlink_session(session* se)
+{
+    if (se->_lru < 0)
+        return;
+
+    session_list& l = _lru[se->_lru];
+
+    if (se->_lru_prev)
+        se->_lru_prev->_lru_next = se->_lru_next;
+    else
+        l.head = se->_lru_next;
+
+    if (se->_lru_next)
+        se->_lru_next->_lru_prev = se->_lru_prev;
+    else
+        l.tail = se->_lru_prev;
+
+    se->_lru      = -1;
+    se->_lru_prev = 0;
+    se->_lru_next = 0;
+}
+
+void proxy::evict_session()
+{
+    for (int i = 0; i < LRU_COUNT; i++) {
+        if (!_lru[i].head)
+            continue;
+
+        ptr<session> se = _lru[i].head;
+
+        NDPPD_DEBUG << "proxy::evict_session() taddr=" << se->taddr();
+
+        remove_session(se);
+        _evictions++;
+        return;
+    }
+}
+
+void proxy::dump_stats()
+{
+    for (std::list<ptr<proxy> >::iterator it = _list.begin();
+            it != _list.end(); it++) {
+        ptr<proxy> pr = *it;
+
+        logger::notice()
+            << "proxy " << (pr->_ifa ? pr->_ifa->name() : "null")
+            << ": rules=" << (int)pr->_rules.size()
+            << ", sessions=" << (int)pr->_sessions.size()
+            << ", max_sessions=" << pr->_max_sessions
+            << ", evictions=" << logger::format("%llu", (unsigned long long)pr->_evictions)
+            << ", miss_hits=" << logger::format("%llu", (unsigned long long)pr->_miss_hits);
+    }
 }
 
 const ptr<iface>& proxy::ifa() const
@@ -317,6 +486,16 @@ void proxy::deadtime(int val)
     _deadtime = (val >= 0) ? val : 30000;
 }
 
+int proxy::max_sessions() const
+{
+    return _max_sessions;
+}
+
+void proxy::max_sessions(int val)
+{
+    _max_sessions = (val >= 0) ? val : 0;
+}
+
 int proxy::timeout() const
 {
     return _timeout;
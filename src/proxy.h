@@ -22,30 +22,41 @@
 #include <sys/poll.h>
 
 #include "ndppd.h"
+#include "trie.h"
+#include "addr_map.h"
 
 NDPPD_NS_BEGIN
 
 class iface;
 class rule;
 
-class proxy {
+class proxy : public ref_counted {
 public:    
     static ptr<proxy> create(const ptr<iface>& ifa, bool promiscuous);
     
-    static ptr<proxy> find_aunt(const std::string& ifname, const address& taddr);
+    static ptr<proxy> find_aunt(int ifid, const address& taddr);
 
-    static ptr<proxy> open(const std::string& ifn, bool promiscuous);
+    static ptr<proxy> open(const std::string& ifn, bool promiscuous, bool rx_ring = false);
     
     ptr<session> find_or_create_session(const address& taddr);
     
-    void handle_advert(const address& saddr, const address& taddr, const std::string& ifname, bool use_via);
+    // The ifid arguments are the iface::id() of the interface the
+    // packet arrived on.
+    void handle_advert(const address& saddr, const address& taddr, int ifid, bool use_via);
     
-    void handle_stateless_advert(const address& saddr, const address& taddr, const std::string& ifname, bool use_via);
+    void handle_stateless_advert(const address& saddr, const address& taddr, int ifid, bool use_via);
     
-    void handle_solicit(const address& saddr, const address& taddr, const std::string& ifname);
+    void handle_solicit(const address& saddr, const address& taddr, int ifid);
 
     void remove_session(const ptr<session>& se);
 
+    // Moves se to the back of the eviction order. Sessions that haven't
+    // been confirmed by an advert go before the ones that have.
+    void touch_session(session* se);
+
+    // Logs the session counters of all proxies.
+    static void dump_stats();
+
     ptr<rule> add_rule(const address& addr, const ptr<iface>& ifa, bool autovia);
 
     ptr<rule> add_rule(const address& addr, bool aut = false);
@@ -54,6 +65,21 @@ public:
     
     std::list<ptr<rule> >::iterator rules_end();
 
+    // Builds the prefix index used by find_rules(). Called once all the
+    // rules have been added.
+    void compile();
+
+    // Stores every rule whose address matches addr in out, in the order
+    // the rules were configured. The rules belong to the proxy and stay
+    // valid as long as it does.
+    void find_rules(const address& addr, std::vector<rule*>& out);
+
+    // Returns true if addr matched none of the rules recently.
+    bool is_miss(const address& addr);
+
+    // Remembers that addr matched none of the rules, for deadtime().
+    void add_miss(const address& addr);
+
     const ptr<iface>& ifa() const;
     
     bool promiscuous() const;
@@ -86,6 +112,11 @@ public:
 
     void deadtime(int val);
 
+    // Maximum number of sessions, or 0 for no limit.
+    int max_sessions() const;
+
+    void max_sessions(int val);
+
 private:
     static std::list<ptr<proxy> > _list;
 
@@ -95,7 +126,54 @@ private:
 
     std::list<ptr<rule> > _rules;
 
-    std::list<ptr<session> > _sessions;
+    // _rules in configuration order, and a prefix index into it.
+    std::vector<ptr<rule> > _rule_vec;
+
+    trie<int> _rule_trie;
+
+    bool _compiled;
+
+    // Sessions of this proxy, keyed by target address.
+    addr_map<ptr<session> > _sessions;
+
+    // Sessions from least to most recently used: the ones waiting for
+    // an advert or found invalid, then the ones that are valid. The
+    // first one is evicted when _max_sessions is reached.
+    enum { LRU_UNCONFIRMED, LRU_CONFIRMED, LRU_COUNT };
+
+    struct session_list {
+        session* head;
+        session* tail;
+    };
+
+    session_list _lru[LRU_COUNT];
+
+    int _max_sessions;
+
+    uint64_t _evictions;
+
+    // Recent targets that matched no rule, so that retransmitted solicits
+    // for them don't go through the rules again. Direct-mapped on the
+    // address hash; a colliding target simply replaces the entry.
+    enum { MISS_SIZE = 256 };
+
+    struct miss {
+        address addr;
+        uint64_t expires;
+    };
+
+    miss _misses[MISS_SIZE];
+
+    // route::generation() the misses were recorded under.
+    unsigned int _miss_generation;
+
+    uint64_t _miss_hits;
+
+    void clear_misses();
+
+    void unlink_session(session* se);
+
+    void evict_session();
     
     bool _promiscuous;
 
@@ -15,255 +15,346 @@
 // along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #pragma once
 
-#include <exception>
+#include <assert.h>
 
 #include "ndppd.h"
-#include "logger.h"
+#include "pool.h"
 
 NDPPD_NS_BEGIN
 
-class invalid_pointer : public std::exception {
-public:
-    invalid_pointer() throw() {};
-};
+template <typename T>
+class ptr;
 
-template <class T>
+template <typename T>
 class weak_ptr;
 
-// This template class simplifies the usage of pointers. It's basically
-// a reference-counting smart pointer that supports both weak and
-// strong references.
+class ref_counted;
 
-template <typename T>
-class ptr {
-    template <typename U>
+// Shared by all weak pointers to an object. obj is cleared when the
+// object goes away, and the block itself when the last weak pointer
+// does.
+struct weak_ref {
+    ref_counted* obj;
+    int count;
+
+    static void* operator new(size_t size)
+    {
+        assert(size == sizeof(weak_ref));
+        return slab().alloc();
+    }
+
+    static void operator delete(void* p)
+    {
+        slab().free(p);
+    }
+
+    static pool<weak_ref>& slab()
+    {
+        static pool<weak_ref> p;
+        return p;
+    }
+};
+
+// Base class of everything handled through ptr<> and weak_ptr<>. The
+// reference count lives in the object itself, so a ptr<> is nothing but
+// a pointer and taking one allocates nothing. The block for weak
+// pointers is only allocated once the first one is taken.
+class ref_counted {
+    template <typename T>
     friend class ptr;
 
-    struct ptr_ref {
-        T* ptr;
-        int wc, sc;
-    };
+    template <typename T>
+    friend class weak_ptr;
 
-protected:
-    bool _weak;
+public:
+    // Number of ptr<> that reference this object.
+    int refs() const
+    {
+        return _refs;
+    }
 
-    ptr_ref* _ref;
+protected:
+    ref_counted() :
+        _refs(0), _weak(0)
+    {
+    }
 
-    void acquire(ptr_ref* ref)
+    // A copy is a new object; nothing references it yet.
+    ref_counted(const ref_counted&) :
+        _refs(0), _weak(0)
     {
-        if (_ref) {
-            release();
-        }
+    }
 
-        if (ref && !ref->sc) {
-            throw new invalid_pointer;
-        }
+    ref_counted& operator=(const ref_counted&)
+    {
+        return *this;
+    }
 
-        if (_ref = ref) {
-            if (_weak) {
-                _ref->wc++;
-            } else {
-                _ref->sc++;
-            }
-        }
+    ~ref_counted()
+    {
+        drop_weak();
     }
 
-    void acquire(void* ptr)
+private:
+    int _refs;
+
+    weak_ref* _weak;
+
+    weak_ref* weak()
     {
-        if (!ptr) return;
+        if (!_weak) {
+            _weak        = new weak_ref;
+            _weak->obj   = this;
+            _weak->count = 0;
+        }
 
-        _ref      = new ptr_ref();
-        _ref->ptr = (T*)ptr;
-        _ref->wc  = !!_weak;
-        _ref->sc  = !_weak;
+        return _weak;
     }
 
-    void release()
+    // Turns all weak pointers to this object into NULL.
+    void drop_weak()
     {
-        if (!_ref) {
+        if (!_weak)
             return;
-        }
 
-        //logger::debug()
-        //    << "ptr::release() _ref=" << logger::format("%x", _ref)
-        //    << ", _ref->wc=" << _ref->wc << ", _ref->sc=" << _ref->sc
-        //    << ", _weak=" << (_weak ? "yes" : "no");
-
-        if (_weak) {
-            assert(_ref->wc > 0);
-            _ref->wc--;
-        } else {
-            assert(_ref->sc > 0);
-            if (!--_ref->sc && _ref->ptr) {
-                T* ptr = _ref->ptr;
-                _ref->ptr = 0;
-                _ref->wc++;
-                delete ptr;
-                _ref->wc--;
-            }
-        }
+        _weak->obj = 0;
 
-        /*if (!_weak && !_ref->sc && _ref->ptr) {
-            T* ptr = (T*)(_ref->ptr);
-            _ref->ptr = 0;
-            delete ptr;
-        }*/
+        if (!_weak->count)
+            delete _weak;
 
-        if (!_ref->sc && !_ref->wc) {
-            delete _ref;
-        }
+        _weak = 0;
+    }
+};
 
-        _ref = 0;
+// A strong reference to a T, which must derive from ref_counted. The
+// object is deleted when the last one goes away.
+template <typename T>
+class ptr {
+    T* _p;
+
+    static void acquire(T* p)
+    {
+        if (p)
+            p->ref_counted::_refs++;
     }
 
-    template <class U>
-    void acquire(const ptr<U>& ptr)
+    static void release(T* p)
     {
-        acquire(ptr._ref);
+        if (p && !--p->ref_counted::_refs) {
+            // Weak pointers see NULL while the destructor runs.
+            p->ref_counted::drop_weak();
+            delete p;
+        }
     }
 
 public:
-    ptr(bool weak = false) :
-        _weak(weak), _ref(0)
+    ptr() :
+        _p(0)
     {
     }
 
-    ptr(T* p, bool weak = false) :
-        _weak(weak), _ref(0)
+    ptr(T* p) :
+        _p(p)
     {
-        acquire(p);
+        acquire(_p);
     }
 
-    ptr(const ptr<T>& p, bool weak = false) :
-        _weak(weak), _ref(0)
+    ptr(const ptr<T>& p) :
+        _p(p._p)
     {
-        acquire(p._ref);
+        acquire(_p);
     }
 
-    ptr(const weak_ptr<T>& p, bool weak = false) :
-        _weak(weak), _ref(0)
+    ptr(const weak_ptr<T>& p) :
+        _p(p.get_pointer())
     {
-        acquire(p._ref);
+        acquire(_p);
     }
 
-    template <class U>
-    ptr(const ptr<U>& p, bool weak = false) :
-        _weak(weak), _ref(0)
+#if __cplusplus >= 201103L
+    ptr(ptr<T>&& p) noexcept :
+        _p(p._p)
     {
-        T* x = (U*)0;
-        acquire(p._ref);
+        p._p = 0;
     }
 
-    template <class U>
-    ptr(const weak_ptr<U>& p, bool weak = false) :
-        _weak(weak), _ref(0)
+    ptr<T>& operator=(ptr<T>&& p) noexcept
     {
-        T* x = (U*)0;
-        acquire(p._ref);
+        if (this != &p) {
+            T* old = _p;
+            _p   = p._p;
+            p._p = 0;
+            release(old);
+        }
+
+        return *this;
     }
+#endif
 
     ~ptr()
     {
-        release();
+        release(_p);
     }
 
-    void operator=(T* p)
+    ptr<T>& operator=(T* p)
     {
-        acquire(p);
+        reset(p);
+        return *this;
     }
 
     ptr<T>& operator=(const ptr<T>& p)
     {
-        acquire(p);
-        return* this;
+        reset(p._p);
+        return *this;
     }
 
     bool operator==(const ptr<T>& other) const
     {
-        return other._ref == _ref;
+        return other._p == _p;
     }
 
     bool operator!=(const ptr<T>& other) const
     {
-        return other._ref != _ref;
+        return other._p != _p;
     }
 
     bool is_null() const
     {
-        return !_ref || !_ref->ptr;
+        return !_p;
     }
 
     T& operator*() const
     {
-        return* get_pointer();
+        assert(_p);
+        return *_p;
     }
 
     T* operator->() const
     {
-        return get_pointer();
+        assert(_p);
+        return _p;
     }
 
     operator T*() const
     {
-        return get_pointer();
+        return _p;
     }
 
     operator bool() const
     {
-        return !is_null();
+        return _p != 0;
     }
 
     void reset(T* p = 0)
     {
+        // In this order in case p is only kept alive by us.
         acquire(p);
+        T* old = _p;
+        _p = p;
+        release(old);
     }
 
     T* get_pointer() const
     {
-        if (!_ref || !_ref->ptr) {
-            throw new invalid_pointer;
-        }
-
-        return static_cast<T* >(_ref->ptr);
+        return _p;
     }
 };
 
+// A reference to a T that doesn't keep it alive. Turns NULL once the
+// object has been deleted; convert it to a ptr<> to hold on to it.
 template <typename T>
-class weak_ptr : public ptr<T> {
+class weak_ptr {
+    weak_ref* _ref;
+
+    static weak_ref* acquire(T* p)
+    {
+        if (!p)
+            return 0;
+
+        weak_ref* ref = p->ref_counted::weak();
+        ref->count++;
+        return ref;
+    }
+
+    static void release(weak_ref* ref)
+    {
+        if (ref && !--ref->count && !ref->obj)
+            delete ref;
+    }
+
 public:
     weak_ptr() :
-        ptr<T>(true)
+        _ref(0)
     {
     }
 
     weak_ptr(T* p) :
-        ptr<T>(p, true)
+        _ref(acquire(p))
     {
     }
 
     weak_ptr(const ptr<T>& p) :
-        ptr<T>(p, true)
+        _ref(acquire(p.get_pointer()))
     {
     }
 
     weak_ptr(const weak_ptr<T>& p) :
-        ptr<T>(p, true)
+        _ref(p._ref)
     {
+        if (_ref)
+            _ref->count++;
     }
 
-    template <class U>
-    weak_ptr(const ptr<U>& p) :
-        ptr<T>(p, true)
+    ~weak_ptr()
     {
+        release(_ref);
     }
 
-    template <class U>
-    weak_ptr(const weak_ptr<U>& p) :
-        ptr<T>(p, true)
+    weak_ptr<T>& operator=(const weak_ptr<T>& p)
     {
+        if (p._ref)
+            p._ref->count++;
+
+        release(_ref);
+        _ref = p._ref;
+        return *this;
     }
-};
 
-NDPPD_NS_END
+    weak_ptr<T>& operator=(const ptr<T>& p)
+    {
+        weak_ref* ref = acquire(p.get_pointer());
+        release(_ref);
+        _ref = ref;
+        return *this;
+    }
 
+    bool operator==(const weak_ptr<T>& other) const
+    {
+        return get_pointer() == other.get_pointer();
+    }
+
+    bool is_null() const
+    {
+        return !get_pointer();
+    }
 
+    T* operator->() const
+    {
+        T* p = get_pointer();
+        assert(p);
+        return p;
+    }
+
+    operator bool() const
+    {
+        return !is_null();
+    }
+
+    // Returns the object, or NULL if it's gone.
+    T* get_pointer() const
+    {
+        return (_ref && _ref->obj) ? static_cast<T* >(_ref->obj) : 0;
+    }
+};
+
+NDPPD_NS_END
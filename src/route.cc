@@ -13,143 +13,83 @@
 //
 // You should have received a copy of the GNU General Public License
 // along with this program.  If not, see <http://www.gnu.org/licenses/>.
-#include <list>
 #include <memory>
-#include <fstream>
+
+#include <net/if.h>
 
 #include "ndppd.h"
 #include "route.h"
 
 NDPPD_NS_BEGIN
 
-std::list<ptr<route> > route::_routes;
-
-int route::_ttl;
+trie<ptr<route> > route::_routes;
 
-int route::_c_ttl;
+unsigned int route::_generation = 0;
 
-route::route(const address& addr, const std::string& ifname) :
-    _addr(addr), _ifname(ifname)
+route::route(const address& addr, int ifindex) :
+    _addr(addr), _ifindex(ifindex)
 {
 }
 
-size_t route::hexdec(const char* str, unsigned char* buf, size_t size)
+ptr<route> route::create(const address& addr, int ifindex)
 {
-    for (size_t i = 0; ; i++) {
-        if (i >= size) {
-            return i;
-        }
-
-        char c1 = tolower(str[i*  2]), c2 = tolower(str[i*  2 + 1]);
-
-        if (!isxdigit(c1) || !isxdigit(c2)) {
-            return i;
-        }
+    const std::vector<ptr<route> >* rts = _routes.find(addr);
 
-        if ((c1 >= '0') && (c1 <= '9')) {
-            buf[i] = (c1 - '0') << 4;
-        } else {
-            buf[i] = ((c1 - 'a') + 10) << 4;
-        }
-
-        if ((c2 >= '0') && (c2 <= '9')) {
-            buf[i] |= c2 - '0';
-        } else {
-            buf[i] |= (c2 - 'a') + 10;
+    if (rts) {
+        for (std::vector<ptr<route> >::const_iterator it = rts->begin();
+                it != rts->end(); it++) {
+            if ((*it)->ifindex() == ifindex)
+                return *it;
         }
     }
+
+    ptr<route> rt(new route(addr, ifindex));
+    // logger::debug() << "route::create() addr=" << addr << ", ifindex=" << ifindex;
+    _routes.insert(addr, rt);
+    _generation++;
+    return rt;
 }
 
-std::string route::token(const char* str)
+void route::remove(const address& addr, int ifindex)
 {
-    while (*str && isspace(*str)) {
-        str++;
-    }
+    const std::vector<ptr<route> >* rts = _routes.find(addr);
 
-    if (!*str) {
-        return "";
-    }
+    if (!rts)
+        return;
 
-    std::stringstream ss;
+    // Copy, since removing from the trie invalidates rts.
+    std::vector<ptr<route> > tmp(*rts);
 
-    while (*str && !isspace(*str)) {
-        ss <<* str++;
+    for (std::vector<ptr<route> >::iterator it = tmp.begin();
+            it != tmp.end(); it++) {
+        if (!ifindex || ((*it)->ifindex() == ifindex)) {
+            _routes.remove(addr, *it);
+            _generation++;
+        }
     }
-
-    return ss.str();
 }
 
-void route::load(const std::string& path)
+void route::clear()
 {
-    // Hack to make sure the interfaces are not freed prematurely.
-    std::list<ptr<route> > tmp_routes(_routes);
     _routes.clear();
-
-    logger::debug() << "reading routes";
-
-    try {
-        std::ifstream ifs;
-        ifs.exceptions(std::ifstream::badbit | std::ifstream::failbit);
-        ifs.open(path.c_str(), std::ios::in);
-        ifs.exceptions(std::ifstream::badbit);
-
-        while (!ifs.eof()) {
-            char buf[1024];
-            ifs.getline(buf, sizeof(buf));
-
-            if (ifs.gcount() < 149) {
-                continue;
-            }
-
-            address addr;
-
-            unsigned char pfx;
-
-            if (route::hexdec(buf, (unsigned char* )&addr.addr(), 16) != 16) {
-                // TODO: Warn here?
-                continue;
-            }
-
-            if (route::hexdec(buf + 33,& pfx, 1) != 1) {
-                // TODO: Warn here?
-                continue;
-            }
-
-            addr.prefix((int)pfx);
-
-            route::create(addr, route::token(buf + 141));
-        }
-    } catch (std::ifstream::failure e) {
-        logger::warning() << "Failed to parse IPv6 routing data from '" << path << "'";
-        logger::error() << e.what();
-    }
+    _generation++;
 }
 
-void route::update(int elapsed_time)
+size_t route::count()
 {
-    if ((_c_ttl -= elapsed_time) <= 0) {
-        load("/proc/net/ipv6_route");
-        _c_ttl = _ttl;
-    }
+    return _routes.size();
 }
 
-ptr<route> route::create(const address& addr, const std::string& ifname)
+unsigned int route::generation()
 {
-    ptr<route> rt(new route(addr, ifname));
-    // logger::debug() << "route::create() addr=" << addr << ", ifname=" << ifname;
-    _routes.push_back(rt);
-    return rt;
+    return _generation;
 }
 
 ptr<route> route::find(const address& addr)
 {
-    for (std::list<ptr<route> >::iterator it = _routes.begin();
-            it != _routes.end(); it++) {
-        if ((*it)->addr() == addr)
-            return *it;
-    }
-
-    return ptr<route>();
+    ptr<route> rt;
+    _routes.longest(addr, rt);
+    return rt;
 }
 
 ptr<iface> route::find_and_open(const address& addr)
@@ -163,19 +103,24 @@ ptr<iface> route::find_and_open(const address& addr)
     return ptr<iface>();
 }
 
-const std::string& route::ifname() const
+int route::ifindex() const
 {
-    return _ifname;
+    return _ifindex;
 }
 
 ptr<iface> route::ifa()
 {
     if (!_ifa) {
-        logger::debug() << "router::ifa() opening interface '" << _ifname << "'";
-        return _ifa = iface::open_ifd(_ifname);
+        char ifname[IF_NAMESIZE];
+
+        if (!if_indextoname(_ifindex, ifname))
+            return _ifa;
+
+        NDPPD_DEBUG << "router::ifa() opening interface '" << ifname << "'";
+        _ifa = iface::open_ifd(ifname);
     }
 
-    return ptr<iface>();
+    return _ifa;
 }
 
 const address& route::addr() const
@@ -183,15 +128,5 @@ const address& route::addr() const
     return _addr;
 }
 
-int route::ttl()
-{
-    return _ttl;
-}
-
-void route::ttl(int ttl)
-{
-    _ttl = ttl;
-}
-
 NDPPD_NS_END
 
@@ -16,53 +16,52 @@
 #pragma once
 
 #include <string>
-#include <list>
 #include <memory>
 
 #include "ndppd.h"
+#include "trie.h"
 
 NDPPD_NS_BEGIN
 
-class route {
+class route : public ref_counted {
 public:
-    static ptr<route> create(const address& addr, const std::string& ifname);
+    static ptr<route> create(const address& addr, int ifindex);
 
-    static ptr<route> find(const address& addr);
+    // Removes the route to addr through the interface with the kernel
+    // index ifindex, or every route to addr if ifindex is 0.
+    static void remove(const address& addr, int ifindex);
 
-    static ptr<iface> find_and_open(const address& addr);
+    static void clear();
 
-    static void load(const std::string& path);
+    static size_t count();
 
-    static void update(int elapsed_time);
+    // Changes whenever a route is added or removed.
+    static unsigned int generation();
 
-    static int ttl();
+    // Returns the most specific route to addr.
+    static ptr<route> find(const address& addr);
 
-    static void ttl(int ttl);
+    static ptr<iface> find_and_open(const address& addr);
 
-    const std::string& ifname() const;
+    int ifindex() const;
 
     const address& addr() const;
 
     ptr<iface> ifa();
     
-    route(const address& addr, const std::string& ifname);
-
-    static size_t hexdec(const char* str, unsigned char* buf, size_t size);
-
-    static std::string token(const char* str);
+    route(const address& addr, int ifindex);
 
 private:
-    static int _ttl;
-
-    static int _c_ttl;
-
     address _addr;
 
-    std::string _ifname;
+    int _ifindex;
 
     ptr<iface> _ifa;
 
-    static std::list<ptr<route> > _routes;
+    // The kernel's main routing table, kept current by rtnl.
+    static trie<ptr<route> > _routes;
+
+    static unsigned int _generation;
 
 };
 
@@ -0,0 +1,455 @@
+// ndppd - NDP Proxy Daemon
+// Copyright (C) 2011  Daniel Adolfsson <daniel@priv.nu>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#include <cstring>
+#include <sstream>
+
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <net/if.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+#include "ndppd.h"
+#include "rtnl.h"
+#include "poller.h"
+#include "route.h"
+#include "address.h"
+
+NDPPD_NS_BEGIN
+
+int rtnl::_fd = -1;
+
+uint32_t rtnl::_seq = 0;
+
+std::map<uint32_t, std::string> rtnl::_pending;
+
+std::deque<int> rtnl::_dumps;
+
+uint32_t rtnl::_dump_seq = 0;
+
+bool rtnl::_routes = false;
+
+bool rtnl::_addresses = false;
+
+bool rtnl::open()
+{
+    if (_fd >= 0)
+        return true;
+
+    int fd;
+
+    if ((fd = socket(AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_ROUTE)) < 0) {
+        logger::error() << "Unable to create netlink socket: " << logger::err();
+        return false;
+    }
+
+    struct sockaddr_nl snl;
+    memset(&snl, 0, sizeof(snl));
+    snl.nl_family = AF_NETLINK;
+
+    if (bind(fd, (struct sockaddr* )&snl, sizeof(snl)) < 0) {
+        ::close(fd);
+        logger::error() << "Failed to bind netlink socket: " << logger::err();
+        return false;
+    }
+
+    // A full routing table arrives in one burst; give the kernel room for
+    // it so that we don't have to start over.
+    int rcvbuf = 4 * 1024 * 1024;
+
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &rcvbuf, sizeof(rcvbuf)) < 0)
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+    _fd = fd;
+
+    if (!poller::add(fd, &rtnl::handle, NULL)) {
+        ::close(fd);
+        _fd = -1;
+        return false;
+    }
+
+    NDPPD_DEBUG << "rtnl::open() fd=" << fd;
+
+    return true;
+}
+
+void rtnl::close()
+{
+    if (_fd < 0)
+        return;
+
+    poller::remove(_fd);
+    ::close(_fd);
+    _fd = -1;
+    _pending.clear();
+    _dumps.clear();
+    _dump_seq = 0;
+}
+
+static void add_attr(struct nlmsghdr* nlh, int type, const void* data, size_t len)
+{
+    struct rtattr* rta = (struct rtattr* )((uint8_t* )nlh + NLMSG_ALIGN(nlh->nlmsg_len));
+    rta->rta_type = type;
+    rta->rta_len  = RTA_LENGTH(len);
+    memcpy(RTA_DATA(rta), data, len);
+    nlh->nlmsg_len = NLMSG_ALIGN(nlh->nlmsg_len) + RTA_ALIGN(rta->rta_len);
+}
+
+bool rtnl::route_request(int type, int flags, const address& dst, const address& via, int ifindex)
+{
+    uint64_t buf[32];
+    memset(buf, 0, sizeof(buf));
+
+    struct nlmsghdr* nlh = (struct nlmsghdr* )buf;
+    nlh->nlmsg_len   = NLMSG_LENGTH(sizeof(struct rtmsg));
+    nlh->nlmsg_type  = type;
+    nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK | flags;
+
+    struct rtmsg* rtm = (struct rtmsg* )NLMSG_DATA(nlh);
+    rtm->rtm_family  = AF_INET6;
+    rtm->rtm_dst_len = dst.prefix();
+    rtm->rtm_table   = RT_TABLE_MAIN;
+
+    if (type == RTM_NEWROUTE) {
+        rtm->rtm_protocol = RTPROT_BOOT;
+        rtm->rtm_scope    = RT_SCOPE_UNIVERSE;
+        rtm->rtm_type     = RTN_UNICAST;
+    } else {
+        rtm->rtm_scope    = RT_SCOPE_NOWHERE;
+    }
+
+    add_attr(nlh, RTA_DST, &dst.const_addr(), sizeof(struct in6_addr));
+
+    if (!via.is_empty())
+        add_attr(nlh, RTA_GATEWAY, &via.const_addr(), sizeof(struct in6_addr));
+
+    add_attr(nlh, RTA_OIF, &ifindex, sizeof(ifindex));
+
+    std::stringstream what;
+    what << ((type == RTM_NEWROUTE) ? "route replace " : "route del ") << dst.to_string();
+    if (!via.is_empty())
+        what << " via " << via.to_string();
+    what << " ifindex " << ifindex;
+
+    return send(nlh, what.str());
+}
+
+bool rtnl::route_replace(const address& dst, const address& via, int ifindex)
+{
+    return route_request(RTM_NEWROUTE, NLM_F_CREATE | NLM_F_REPLACE, dst, via, ifindex);
+}
+
+bool rtnl::route_delete(const address& dst, const address& via, int ifindex)
+{
+    return route_request(RTM_DELROUTE, 0, dst, via, ifindex);
+}
+
+bool rtnl::send(struct nlmsghdr* nlh, const std::string& what)
+{
+    if (!open())
+        return false;
+
+    nlh->nlmsg_seq = ++_seq;
+
+    struct sockaddr_nl snl;
+    memset(&snl, 0, sizeof(snl));
+    snl.nl_family = AF_NETLINK;
+
+    NDPPD_DEBUG << "rtnl::send() seq=" << (int)nlh->nlmsg_seq << ", " << what;
+
+    if (sendto(_fd, nlh, nlh->nlmsg_len, 0, (struct sockaddr* )&snl, sizeof(snl)) < 0) {
+        logger::error() << "Failed to send netlink request (" << what << "): " << logger::err();
+        return false;
+    }
+
+    if (nlh->nlmsg_flags & NLM_F_ACK)
+        _pending[nlh->nlmsg_seq] = what;
+
+    return true;
+}
+
+bool rtnl::subscribe(int group)
+{
+    if (!open())
+        return false;
+
+    if (setsockopt(_fd, SOL_NETLINK, NETLINK_ADD_MEMBERSHIP, &group, sizeof(group)) < 0) {
+        logger::error() << "Failed to join netlink group " << group << ": " << logger::err();
+        return false;
+    }
+
+    return true;
+}
+
+void rtnl::dump(int type)
+{
+    _dumps.push_back(type);
+
+    if (!_dump_seq)
+        next_dump();
+}
+
+void rtnl::next_dump()
+{
+    _dump_seq = 0;
+
+    while (!_dumps.empty() && !_dump_seq) {
+        int type = _dumps.front();
+        _dumps.pop_front();
+
+        uint64_t buf[8];
+        memset(buf, 0, sizeof(buf));
+
+        struct nlmsghdr* nlh = (struct nlmsghdr* )buf;
+        nlh->nlmsg_len   = NLMSG_LENGTH((type == RTM_GETADDR) ?
+                               sizeof(struct ifaddrmsg) : sizeof(struct rtmsg));
+        nlh->nlmsg_type  = type;
+        nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+
+        // Both ifaddrmsg and rtmsg start with the address family.
+        *(uint8_t* )NLMSG_DATA(nlh) = AF_INET6;
+
+        if (send(nlh, "dump"))
+            _dump_seq = nlh->nlmsg_seq;
+    }
+}
+
+void rtnl::resync()
+{
+    logger::warning() << "Lost netlink notifications, reloading";
+
+    _dumps.clear();
+
+    if (_addresses) {
+        address::clear();
+        _dumps.push_back(RTM_GETADDR);
+    }
+
+    if (_routes) {
+        route::clear();
+        _dumps.push_back(RTM_GETROUTE);
+    }
+
+    next_dump();
+}
+
+bool rtnl::watch_routes()
+{
+    if (_routes)
+        return true;
+
+    if (!subscribe(RTNLGRP_IPV6_ROUTE))
+        return false;
+
+    _routes = true;
+    dump(RTM_GETROUTE);
+    return true;
+}
+
+bool rtnl::watch_addresses()
+{
+    if (_addresses)
+        return true;
+
+    if (!subscribe(RTNLGRP_IPV6_IFADDR))
+        return false;
+
+    _addresses = true;
+    dump(RTM_GETADDR);
+    return true;
+}
+
+bool rtnl::watch_links()
+{
+    return subscribe(RTNLGRP_LINK);
+}
+
+void rtnl::handle_link(struct nlmsghdr* nlh)
+{
+    struct ifinfomsg* ifi = (struct ifinfomsg* )NLMSG_DATA(nlh);
+
+    if (nlh->nlmsg_len < NLMSG_LENGTH(sizeof(struct ifinfomsg)))
+        return;
+
+    const struct ether_addr* hw = NULL;
+
+    int len = IFLA_PAYLOAD(nlh);
+
+    for (struct rtattr* rta = IFLA_RTA(ifi); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+        if ((rta->rta_type == IFLA_ADDRESS) && (RTA_PAYLOAD(rta) == sizeof(struct ether_addr)))
+            hw = (const struct ether_addr* )RTA_DATA(rta);
+    }
+
+    if (hw)
+        iface::update_hwaddr(ifi->ifi_index, *hw);
+}
+
+void rtnl::handle_addr(struct nlmsghdr* nlh)
+{
+    struct ifaddrmsg* ifa = (struct ifaddrmsg* )NLMSG_DATA(nlh);
+
+    if (nlh->nlmsg_len < NLMSG_LENGTH(sizeof(struct ifaddrmsg)))
+        return;
+
+    if (ifa->ifa_family != AF_INET6)
+        return;
+
+    const struct in6_addr* addr = NULL;
+
+    int len = IFA_PAYLOAD(nlh);
+
+    for (struct rtattr* rta = IFA_RTA(ifa); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+        // IFA_LOCAL, if present, is our end of a point-to-point link.
+        if ((rta->rta_type == IFA_LOCAL) || ((rta->rta_type == IFA_ADDRESS) && !addr))
+            addr = (const struct in6_addr* )RTA_DATA(rta);
+    }
+
+    if (!addr)
+        return;
+
+    if (nlh->nlmsg_type == RTM_DELADDR)
+        address::remove(address(*addr), ifa->ifa_index);
+    else
+        address::add(address(*addr), ifa->ifa_index);
+}
+
+void rtnl::handle_route(struct nlmsghdr* nlh)
+{
+    struct rtmsg* rtm = (struct rtmsg* )NLMSG_DATA(nlh);
+
+    if (nlh->nlmsg_len < NLMSG_LENGTH(sizeof(struct rtmsg)))
+        return;
+
+    if ((rtm->rtm_family != AF_INET6) || (rtm->rtm_type != RTN_UNICAST) ||
+            (rtm->rtm_flags & RTM_F_CLONED))
+        return;
+
+    int table = rtm->rtm_table, ifindex = 0;
+    struct in6_addr dst;
+    memset(&dst, 0, sizeof(dst));
+
+    int len = RTM_PAYLOAD(nlh);
+
+    for (struct rtattr* rta = RTM_RTA(rtm); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+        switch (rta->rta_type) {
+        case RTA_TABLE:
+            table = *(uint32_t* )RTA_DATA(rta);
+            break;
+
+        case RTA_DST:
+            memcpy(&dst, RTA_DATA(rta), sizeof(dst));
+            break;
+
+        case RTA_OIF:
+            ifindex = *(int* )RTA_DATA(rta);
+            break;
+
+        case RTA_MULTIPATH:
+            // Go with the first nexthop.
+            if (!ifindex && (RTA_PAYLOAD(rta) >= sizeof(struct rtnexthop)))
+                ifindex = ((struct rtnexthop* )RTA_DATA(rta))->rtnh_ifindex;
+            break;
+        }
+    }
+
+    if ((table != RT_TABLE_MAIN) || !ifindex)
+        return;
+
+    address addr(dst, rtm->rtm_dst_len);
+
+    if (nlh->nlmsg_type == RTM_DELROUTE) {
+        route::remove(addr, ifindex);
+    } else {
+        if (nlh->nlmsg_flags & NLM_F_REPLACE)
+            route::remove(addr, 0);
+
+        route::create(addr, ifindex);
+    }
+}
+
+void rtnl::handle(void* obj)
+{
+    uint8_t buf[65536];
+
+    while (_fd >= 0) {
+        int len = recv(_fd, buf, sizeof(buf), 0);
+
+        if (len < 0) {
+            if (errno == ENOBUFS) {
+                resync();
+                continue;
+            }
+
+            if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR))
+                logger::error() << "Failed to read from netlink socket: " << logger::err();
+            break;
+        }
+
+        for (struct nlmsghdr* nlh = (struct nlmsghdr* )buf; NLMSG_OK(nlh, len);
+                nlh = NLMSG_NEXT(nlh, len)) {
+            switch (nlh->nlmsg_type) {
+            case RTM_NEWROUTE:
+            case RTM_DELROUTE:
+                handle_route(nlh);
+                continue;
+
+            case RTM_NEWADDR:
+            case RTM_DELADDR:
+                handle_addr(nlh);
+                continue;
+
+            case RTM_NEWLINK:
+                handle_link(nlh);
+                continue;
+
+            case NLMSG_DONE:
+                if (_dump_seq && (nlh->nlmsg_seq == _dump_seq))
+                    next_dump();
+                continue;
+
+            case NLMSG_ERROR:
+                break;
+
+            default:
+                continue;
+            }
+
+            if (_dump_seq && (nlh->nlmsg_seq == _dump_seq))
+                next_dump();
+
+            struct nlmsgerr* err = (struct nlmsgerr* )NLMSG_DATA(nlh);
+
+            std::map<uint32_t, std::string>::iterator it = _pending.find(nlh->nlmsg_seq);
+            std::string what = (it != _pending.end()) ? it->second : "unknown request";
+
+            if (it != _pending.end())
+                _pending.erase(it);
+
+            if (!err->error) {
+                NDPPD_DEBUG << "rtnl::handle() seq=" << (int)nlh->nlmsg_seq << " done";
+            } else if ((err->error == -ESRCH) || (err->error == -ENOENT)) {
+                // Removing a route that is already gone.
+                NDPPD_DEBUG << "rtnl::handle() seq=" << (int)nlh->nlmsg_seq << " " << what
+                                << ": " << strerror(-err->error);
+            } else {
+                logger::warning() << "Netlink request failed (" << what << "): " << strerror(-err->error);
+            }
+        }
+    }
+}
+
+NDPPD_NS_END
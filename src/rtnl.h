@@ -0,0 +1,99 @@
+// ndppd - NDP Proxy Daemon
+// Copyright (C) 2011  Daniel Adolfsson <daniel@priv.nu>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#pragma once
+
+#include <string>
+#include <map>
+#include <deque>
+#include <stdint.h>
+
+#include "ndppd.h"
+
+struct nlmsghdr;
+
+NDPPD_NS_BEGIN
+
+// The daemon's RTNETLINK socket. Requests are sent without waiting for
+// the kernel; acknowledgements are picked up by the poller and failures
+// are logged against the request that caused them.
+class rtnl {
+public:
+    static bool open();
+
+    static void close();
+
+    // Adds or replaces the route to dst through ifindex, via the gateway
+    // via unless it is empty. Same as "ip -6 route replace".
+    static bool route_replace(const address& dst, const address& via, int ifindex);
+
+    // Removes the route to dst through ifindex (and via, unless it is
+    // empty). Same as "ip -6 route del".
+    static bool route_delete(const address& dst, const address& via, int ifindex);
+
+    // Loads the main IPv6 routing table into route, and keeps it current
+    // from RTNLGRP_IPV6_ROUTE notifications.
+    static bool watch_routes();
+
+    // Loads the local IPv6 addresses into address, and keeps them current
+    // from RTNLGRP_IPV6_IFADDR notifications.
+    static bool watch_addresses();
+
+    // Passes link-layer address changes on to iface, from RTNLGRP_LINK
+    // notifications.
+    static bool watch_links();
+
+private:
+    static int _fd;
+
+    static uint32_t _seq;
+
+    // Description of every request still waiting for its ack, by sequence.
+    static std::map<uint32_t, std::string> _pending;
+
+    // Dump requests waiting for the one in progress to finish; netlink
+    // only runs one dump per socket at a time.
+    static std::deque<int> _dumps;
+
+    // Sequence number of the dump in progress, or 0.
+    static uint32_t _dump_seq;
+
+    static bool _routes, _addresses;
+
+    static bool send(struct nlmsghdr* nlh, const std::string& what);
+
+    static bool route_request(int type, int flags, const address& dst, const address& via, int ifindex);
+
+    static bool subscribe(int group);
+
+    static void dump(int type);
+
+    static void next_dump();
+
+    // Starts over from fresh dumps after the kernel had to drop
+    // notifications.
+    static void resync();
+
+    static void handle_route(struct nlmsghdr* nlh);
+
+    static void handle_addr(struct nlmsghdr* nlh);
+
+    static void handle_link(struct nlmsghdr* nlh);
+
+    // Called by the poller when the socket becomes readable.
+    static void handle(void* obj);
+};
+
+NDPPD_NS_END
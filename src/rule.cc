@@ -25,8 +25,6 @@
 
 NDPPD_NS_BEGIN
 
-std::vector<interface> interfaces;
-
 bool rule::_any_aut = false;
 
 bool rule::_any_iface = false;
@@ -46,18 +44,8 @@ ptr<rule> rule::create(const ptr<proxy>& pr, const address& addr, const ptr<ifac
     ru->_addr = addr;
     ru->_aut  = false;
     _any_iface = true;
-    unsigned int ifindex;
-
-    ifindex = if_nametoindex(pr->ifa()->name().c_str());
-#ifdef WITH_ND_NETLINK
-    if_add_to_list(ifindex, pr->ifa());
-#endif
-    ifindex = if_nametoindex(ifa->name().c_str());
-#ifdef WITH_ND_NETLINK
-    if_add_to_list(ifindex, ifa);
-#endif
 
-    logger::debug() << "rule::create() if=" << pr->ifa()->name() << ", slave=" << ifa->name() << ", addr=" << addr;
+    NDPPD_DEBUG << "rule::create() if=" << pr->ifa()->name() << ", slave=" << ifa->name() << ", addr=" << addr;
 
     return ru;
 }
@@ -74,7 +62,7 @@ ptr<rule> rule::create(const ptr<proxy>& pr, const address& addr, bool aut)
     if (aut == false)
         _any_static = true;
 
-    logger::debug()
+    NDPPD_DEBUG
         << "rule::create() if=" << pr->ifa()->name().c_str() << ", addr=" << addr
         << ", auto=" << (aut ? "yes" : "no");
 
@@ -86,7 +74,7 @@ const address& rule::addr() const
     return _addr;
 }
 
-ptr<iface> rule::daughter() const
+const ptr<iface>& rule::daughter() const
 {
     return _daughter;
 }
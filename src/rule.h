@@ -29,7 +29,7 @@ NDPPD_NS_BEGIN
 class iface;
 class proxy;
 
-class rule {
+class rule : public ref_counted {
 public:
     static ptr<rule> create(const ptr<proxy>& pr, const address& addr, const ptr<iface>& ifa);
 
@@ -37,7 +37,7 @@ public:
 
     const address& addr() const;
 
-    ptr<iface> daughter() const;
+    const ptr<iface>& daughter() const;
 
     bool is_auto() const;
 
@@ -75,19 +75,4 @@ private:
     rule();
 };
 
-class interface {
-public:
-    // List of IPv6 addresses on this interface
-    std::list<address> addresses;
-
-    // Index of this interface
-    int ifindex;
-
-    // Name of this interface.
-    std::string _name;
-
-};
-
-extern std::vector<interface> interfaces;
-
 NDPPD_NS_END
@@ -16,97 +16,125 @@
 #include <algorithm>
 #include <sstream>
 
+#include <net/if.h>
+
 #include "ndppd.h"
 #include "proxy.h"
 #include "iface.h"
 #include "session.h"
+#include "rtnl.h"
+#include "probe.h"
 
 NDPPD_NS_BEGIN
 
-std::list<weak_ptr<session> > session::_sessions;
-
 static address all_nodes = address("ff02::1");
 
-void session::update_all(int elapsed_time)
+static pool<session> session_pool;
+
+void* session::operator new(size_t size)
+{
+    assert(size == sizeof(session));
+    return session_pool.alloc();
+}
+
+void session::operator delete(void* p)
+{
+    session_pool.free(p);
+}
+
+void session::dump_stats()
+{
+    pool<weak_ref>& wp = weak_ref::slab();
+
+    logger::notice()
+        << "memory: sessions=" << (int)session_pool.used() << "/" << (int)session_pool.capacity()
+        << " (" << (int)session_pool.bytes() << " bytes)"
+        << ", weak_refs=" << (int)wp.used() << "/" << (int)wp.capacity()
+        << " (" << (int)wp.bytes() << " bytes)";
+}
+
+void session::expire()
 {
-    for (std::list<weak_ptr<session> >::iterator it = _sessions.begin();
-            it != _sessions.end(); ) {
-        if (!*it) {
-            _sessions.erase(it++);
-            continue;
+    // Keep ourselves alive while the proxy drops its reference.
+    ptr<session> se = _ptr;
+
+    switch (_status) {
+
+    case session::WAITING:
+        if (_fails < _retries) {
+            NDPPD_DEBUG << "session will keep trying [taddr=" << _taddr << "]";
+
+            _timer.schedule(_pr->timeout());
+            _fails++;
+
+            // Send another solicit
+            send_solicit();
+        } else {
+
+            NDPPD_DEBUG << "session is now invalid [taddr=" << _taddr << "]";
+
+            _status = session::INVALID;
+            _timer.schedule(_pr->deadtime());
         }
+        break;
 
-        ptr<session> se = *it++;
+    case session::RENEWING:
+        NDPPD_DEBUG << "session is became invalid [taddr=" << _taddr << "]";
 
-        if ((se->_ttl -= elapsed_time) >= 0) {
-            continue;
+        if (_fails < _retries) {
+            _timer.schedule(_pr->timeout());
+            _fails++;
+
+            // Send another solicit
+            send_solicit();
+        } else {
+            _pr->remove_session(se);
         }
+        break;
 
-        switch (se->_status) {
-            
-        case session::WAITING:
-            if (se->_fails < se->_retries) {
-                logger::debug() << "session will keep trying [taddr=" << se->_taddr << "]";
-                
-                se->_ttl     = se->_pr->timeout();
-                se->_fails++;
-                
-                // Send another solicit
-                se->send_solicit();
-            } else {
-                
-                logger::debug() << "session is now invalid [taddr=" << se->_taddr << "]";
-                
-                se->_status = session::INVALID;
-                se->_ttl    = se->_pr->deadtime();
-            }
-            break;
-            
-        case session::RENEWING:
-            logger::debug() << "session is became invalid [taddr=" << se->_taddr << "]";
-            
-            if (se->_fails < se->_retries) {
-                se->_ttl     = se->_pr->timeout();
-                se->_fails++;
-                
-                // Send another solicit
-                se->send_solicit();
-            } else {            
-                se->_pr->remove_session(se);
+    case session::VALID:
+        // Solicits answered by the fast path count as well.
+        if (_xdp) {
+            uint64_t hits = _xdp->hits(_taddr);
+
+            if (hits != _xdp_hits) {
+                _xdp_hits = hits;
+                _touched  = true;
             }
-            break;
-            
-        case session::VALID:            
-            if (se->touched() == true ||
-                se->keepalive() == true)
-            {
-                logger::debug() << "session is renewing [taddr=" << se->_taddr << "]";
-                se->_status  = session::RENEWING;
-                se->_ttl     = se->_pr->timeout();
-                se->_fails   = 0;
-                se->_touched = false;
-
-                // Send another solicit to make sure the route is still valid
-                se->send_solicit();
-            } else {
-                se->_pr->remove_session(se);
-            }            
-            break;
-
-        default:
-            se->_pr->remove_session(se);
         }
+
+        if (touched() == true ||
+            keepalive() == true)
+        {
+            NDPPD_DEBUG << "session is renewing [taddr=" << _taddr << "]";
+            _status  = session::RENEWING;
+            _timer.schedule(_pr->timeout());
+            _fails   = 0;
+            _touched = false;
+
+            // Send another solicit to make sure the route is still valid
+            send_solicit();
+        } else {
+            _pr->remove_session(se);
+        }
+        break;
+
+    default:
+        _pr->remove_session(se);
     }
 }
 
 session::~session()
 {
-    logger::debug() << "session::~session() this=" << logger::format("%x", this);
+    NDPPD_DEBUG << "session::~session() this=" << logger::format("%x", this);
+
+    if (_xdp)
+        _xdp->remove(_taddr);
     
     if (_wired == true) {
         for (std::list<ptr<iface> >::iterator it = _ifaces.begin();
             it != _ifaces.end(); it++) {
-            handle_auto_unwire((*it)->name());
+            handle_auto_unwire((*it)->id());
         }
     }
 }
@@ -122,12 +150,16 @@ ptr<session> session::create(const ptr<proxy>& pr, const address& taddr, bool au
     se->_keepalive = keepalive;
     se->_retries   = retries;
     se->_wired     = false;
-    se->_ttl       = pr->ttl();
     se->_touched   = false;
+    se->_xdp_hits  = 0;
+    se->_lru_prev  = 0;
+    se->_lru_next  = 0;
+    se->_lru       = -1;
 
-    _sessions.push_back(se);
+    se->_timer.bind<session, &session::expire>(se);
+    se->_timer.schedule(pr->ttl());
 
-    logger::debug()
+    NDPPD_DEBUG
         << "session::create() pr=" << logger::format("%x", (proxy* )pr) << ", proxy=" << ((pr->ifa()) ? pr->ifa()->name() : "null")
         << ", taddr=" << taddr << " =" << logger::format("%x", (session* )se);
 
@@ -140,26 +172,30 @@ void session::add_iface(const ptr<iface>& ifa)
         return;
 
     _ifaces.push_back(ifa);
+    _probes.push_back(probe::open(ifa, _taddr));
 }
 
 void session::add_pending(const address& addr)
 {
-    for (std::list<ptr<address> >::iterator ad = _pending.begin(); ad != _pending.end(); ad++) {
+    for (small_vector<address, 2>::iterator ad = _pending.begin(); ad != _pending.end(); ad++) {
         if (addr == (*ad))
             return;
     }
 
-    _pending.push_back(new address(addr));
+    _pending.push_back(addr);
 }
 
 void session::send_solicit()
 {
-    logger::debug() << "session::send_solicit() (_ifaces.size() = " << _ifaces.size() << ")";
+    NDPPD_DEBUG << "session::send_solicit() (_ifaces.size() = " << _ifaces.size() << ")";
 
-    for (std::list<ptr<iface> >::iterator it = _ifaces.begin();
-            it != _ifaces.end(); it++) {
-        logger::debug() << " - " << (*it)->name();
-        (*it)->write_solicit(_taddr);
+    // Another proxy's session may have solicited the target within the
+    // last half timeout; its advert will reach us as well.
+    for (std::vector<ptr<probe> >::iterator it = _probes.begin();
+            it != _probes.end(); it++) {
+        NDPPD_DEBUG << " - " << (*it)->ifa()->name();
+
+        (*it)->send(_pr->timeout() / 2);
     }
 }
 
@@ -170,9 +206,9 @@ void session::touch()
         _touched = true;
         
         if (status() == session::WAITING || status() == session::INVALID) {
-            _ttl = _pr->timeout();
+            _timer.schedule(_pr->timeout());
             
-            logger::debug() << "session is now probing [taddr=" << _taddr << "]";
+            NDPPD_DEBUG << "session is now probing [taddr=" << _taddr << "]";
             
             send_solicit();
         }
@@ -181,113 +217,71 @@ void session::touch()
 
 void session::send_advert(const address& daddr)
 {
-    _pr->ifa()->write_advert(daddr, _taddr, _pr->router());
+    const ptr<iface>& ifa = _pr->ifa();
+
+    if (!ifa->is_current(_advert) || (_advert.router != _pr->router()))
+        ifa->build_advert(_advert, _taddr, _pr->router());
+
+    ifa->write_advert(_advert, daddr);
 }
 
-void session::handle_auto_wire(const address& saddr, const std::string& ifname, bool use_via)
+void session::handle_auto_wire(const address& saddr, int ifid, bool use_via)
 {
     if (_wired == true && (_wired_via.is_empty() || _wired_via == saddr))
         return;
     
-    logger::debug()
-        << "session::handle_auto_wire() taddr=" << _taddr << ", ifname=" << ifname;
-    
+    NDPPD_DEBUG
+        << "session::handle_auto_wire() taddr=" << _taddr << ", ifid=" << ifid;
+
+    iface* ifa = iface::by_id(ifid);
+
+    if (!ifa) {
+        logger::error() << "Failed to wire " << _taddr << ", no such interface " << ifid;
+        return;
+    }
+
+    int ifindex = ifa->ifindex();
+
     if (use_via == true &&
         _taddr != saddr &&
         saddr.is_unicast() == true &&
         saddr.is_multicast() == false)
     {
-        std::stringstream route_cmd;
-        route_cmd << "ip";
-        route_cmd << " " << "-6";
-        route_cmd << " " << "route";
-        route_cmd << " " << "replace";
-        route_cmd << " " << std::string(saddr);
-        route_cmd << " " << "dev";
-        route_cmd << " " << ifname;
-
-        logger::debug()
-            << "session::system(" << route_cmd.str() << ")";
-        
-        system(route_cmd.str().c_str());
-        
+        rtnl::route_replace(saddr, address(), ifindex);
         _wired_via = saddr;
     }
     else
         _wired_via.reset();
-    
-    {
-        std::stringstream route_cmd;
-        route_cmd << "ip";
-        route_cmd << " " << "-6";
-        route_cmd << " " << "route";
-        route_cmd << " " << "replace";
-        route_cmd << " " << std::string(_taddr);
-        if (_wired_via.is_empty() == false) {
-            route_cmd << " " << "via";
-            route_cmd << " " << std::string(_wired_via);
-        }
-        route_cmd << " " << "dev";
-        route_cmd << " " << ifname;
 
-        logger::debug()
-            << "session::system(" << route_cmd.str() << ")";
+    rtnl::route_replace(_taddr, _wired_via, ifindex);
 
-        system(route_cmd.str().c_str());
-    }
-    
     _wired = true;
 }
 
-void session::handle_auto_unwire(const std::string& ifname)
+void session::handle_auto_unwire(int ifid)
 {
-    logger::debug()
-        << "session::handle_auto_unwire() taddr=" << _taddr << ", ifname=" << ifname;
-    
-    {
-        std::stringstream route_cmd;
-        route_cmd << "ip";
-        route_cmd << " " << "-6";
-        route_cmd << " " << "route";
-        route_cmd << " " << "flush";
-        route_cmd << " " << std::string(_taddr);
-        if (_wired_via.is_empty() == false) {
-            route_cmd << " " << "via";
-            route_cmd << " " << std::string(_wired_via);
-        }
-        route_cmd << " " << "dev";
-        route_cmd << " " << ifname;
+    NDPPD_DEBUG
+        << "session::handle_auto_unwire() taddr=" << _taddr << ", ifid=" << ifid;
 
-        logger::debug()
-            << "session::system(" << route_cmd.str() << ")";
+    iface* ifa = iface::by_id(ifid);
 
-        system(route_cmd.str().c_str());
-    }
-    
-    if (_wired_via.is_empty() == false) {
-        std::stringstream route_cmd;
-        route_cmd << "ip";
-        route_cmd << " " << "-6";
-        route_cmd << " " << "route";
-        route_cmd << " " << "flush";
-        route_cmd << " " << std::string(_wired_via);
-        route_cmd << " " << "dev";
-        route_cmd << " " << ifname;
-
-        logger::debug()
-            << "session::system(" << route_cmd.str() << ")";
-
-        system(route_cmd.str().c_str());
+    if (ifa) {
+        int ifindex = ifa->ifindex();
+
+        rtnl::route_delete(_taddr, _wired_via, ifindex);
+
+        if (_wired_via.is_empty() == false)
+            rtnl::route_delete(_wired_via, address(), ifindex);
     }
-    
+
     _wired = false;
     _wired_via.reset();
 }
 
-void session::handle_advert(const address& saddr, const std::string& ifname, bool use_via)
+void session::handle_advert(const address& saddr, int ifid, bool use_via)
 {
     if (_autowire == true && _status == WAITING) {
-        handle_auto_wire(saddr, ifname, use_via);
+        handle_auto_wire(saddr, ifid, use_via);
     }
     
     handle_advert();
@@ -296,25 +290,28 @@ void session::handle_advert(const address& saddr, const std::string& ifname, boo
 
 void session::handle_advert()
 {
-    logger::debug()
+    NDPPD_DEBUG
         << "session::handle_advert() taddr=" << _taddr << ", ttl=" << _pr->ttl();
     
     if (_status != VALID) {
         _status = VALID;
         
-        logger::debug() << "session is active [taddr=" << _taddr << "]";
+        NDPPD_DEBUG << "session is active [taddr=" << _taddr << "]";
+
+        // From now on the fast path, if any, can answer for us.
+        if (!_xdp && (_xdp = _pr->ifa()->fast_path()))
+            _xdp->add(_taddr, _pr->router());
     }
     
-    _ttl    = _pr->ttl();
+    _timer.schedule(_pr->ttl());
     _fails  = 0;
     
     if (!_pending.empty()) {
-        for (std::list<ptr<address> >::iterator ad = _pending.begin();
+        for (small_vector<address, 2>::iterator ad = _pending.begin();
                 ad != _pending.end(); ad++) {
-            ptr<address> addr = (*ad);
-            logger::debug() << " - forward to " << addr;
+            NDPPD_DEBUG << " - forward to " << *ad;
 
-            send_advert(addr);
+            send_advert(*ad);
         }
 
         _pending.clear();
@@ -19,13 +19,18 @@
 #include <string>
 
 #include "ndppd.h"
+#include "timer.h"
 
 NDPPD_NS_BEGIN
 
 class proxy;
 class iface;
+class xdp;
+class probe;
+
+class session : public ref_counted {
+    friend class proxy;
 
-class session {
 private:
     weak_ptr<session> _ptr;
 
@@ -46,12 +51,26 @@ private:
     // An array of interfaces this session is monitoring for
     // ND_NEIGHBOR_ADVERT on.
     std::list<ptr<iface> > _ifaces;
+
+    // Solicits for _taddr, one for each entry in _ifaces; shared with
+    // the sessions of other proxies on the same interfaces.
+    std::vector<ptr<probe> > _probes;
+
+    // Prebuilt advert sent on behalf of the target.
+    nd_template _advert;
+
+    // Fast path of the proxy interface answering solicits for _taddr
+    // while the session is valid, and its hit count at the last check.
+    ptr<xdp> _xdp;
+
+    uint64_t _xdp_hits;
     
-    std::list<ptr<address> > _pending;
+    // Solicitors waiting for the advert; rarely more than one.
+    small_vector<address, 2> _pending;
 
-    // The remaining time in miliseconds the object will stay in the
-    // interface's session array or cache.
-    int _ttl;
+    // Fires when the session needs attention: a retry, a renewal
+    // or its removal from the proxy's session cache.
+    timer _timer;
     
     int _fails;
     
@@ -59,7 +78,15 @@ private:
 
     int _status;
 
-    static std::list<weak_ptr<session> > _sessions;
+    // Position in the proxy's eviction order; see proxy::touch_session().
+    session* _lru_prev;
+
+    session* _lru_next;
+
+    int _lru;
+
+    // Invoked by _timer.
+    void expire();
 
 public:
     enum
@@ -70,11 +97,16 @@ public:
         INVALID   // Invalid;
     };
 
-    static void update_all(int elapsed_time);
-
     // Destructor.
     ~session();
 
+    // Sessions come from a pool of their own.
+    static void* operator new(size_t size);
+
+    static void operator delete(void* p);
+
+    static void dump_stats();
+
     static ptr<session> create(const ptr<proxy>& pr, const address& taddr, bool autowire, bool keepalive, int retries);
 
     void add_iface(const ptr<iface>& ifa);
@@ -105,11 +137,12 @@ public:
     
     void handle_advert();
 
-    void handle_advert(const address& saddr, const std::string& ifname, bool use_via);
+    // ifid is the iface::id() of the interface the advert arrived on.
+    void handle_advert(const address& saddr, int ifid, bool use_via);
     
-    void handle_auto_wire(const address& saddr, const std::string& ifname, bool use_via);
+    void handle_auto_wire(const address& saddr, int ifid, bool use_via);
     
-    void handle_auto_unwire(const std::string& ifname);
+    void handle_auto_unwire(int ifid);
     
     void touch();
 
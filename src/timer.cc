@@ -0,0 +1,161 @@
+// ndppd - NDP Proxy Daemon
+// Copyright (C) 2011  Daniel Adolfsson <daniel@priv.nu>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#include <time.h>
+
+#include "ndppd.h"
+#include "timer.h"
+
+NDPPD_NS_BEGIN
+
+std::vector<timer*>& timer::_heap = *new std::vector<timer*>();
+
+timer::timer() :
+    _deadline(0), _index(-1), _fn(0), _obj(0)
+{
+}
+
+timer::~timer()
+{
+    cancel();
+}
+
+void timer::bind(handler fn, void* obj)
+{
+    _fn  = fn;
+    _obj = obj;
+}
+
+uint64_t timer::now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void timer::schedule(int ms)
+{
+    uint64_t old = _deadline;
+
+    _deadline = now() + ((ms > 0) ? ms : 1);
+
+    if (_index < 0) {
+        _index = _heap.size();
+        _heap.push_back(this);
+        sift_up(_index);
+    } else if (_deadline < old) {
+        sift_up(_index);
+    } else {
+        sift_down(_index);
+    }
+}
+
+void timer::cancel()
+{
+    if (_index < 0)
+        return;
+
+    int i = _index, last = _heap.size() - 1;
+
+    if (i != last) {
+        swap(i, last);
+        _heap.pop_back();
+        sift_down(i);
+        sift_up(i);
+    } else {
+        _heap.pop_back();
+    }
+
+    _index = -1;
+}
+
+bool timer::pending() const
+{
+    return _index >= 0;
+}
+
+int timer::next_timeout()
+{
+    if (_heap.empty())
+        return -1;
+
+    uint64_t t = now();
+
+    if (_heap[0]->_deadline <= t)
+        return 0;
+
+    return (int)(_heap[0]->_deadline - t);
+}
+
+void timer::run()
+{
+    uint64_t t = now();
+
+    while (!_heap.empty() && (_heap[0]->_deadline <= t)) {
+        timer* tm = _heap[0];
+
+        // Take it off the heap before calling out, since the callback may
+        // reschedule the timer or destroy the object that owns it.
+        tm->cancel();
+
+        if (tm->_fn)
+            tm->_fn(tm->_obj);
+    }
+}
+
+void timer::swap(int i, int j)
+{
+    timer* tmp = _heap[i];
+    _heap[i] = _heap[j];
+    _heap[j] = tmp;
+    _heap[i]->_index = i;
+    _heap[j]->_index = j;
+}
+
+void timer::sift_up(int i)
+{
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+
+        if (_heap[parent]->_deadline <= _heap[i]->_deadline)
+            break;
+
+        swap(i, parent);
+        i = parent;
+    }
+}
+
+void timer::sift_down(int i)
+{
+    int n = _heap.size();
+
+    for (;;) {
+        int l = i * 2 + 1, r = l + 1, m = i;
+
+        if ((l < n) && (_heap[l]->_deadline < _heap[m]->_deadline))
+            m = l;
+
+        if ((r < n) && (_heap[r]->_deadline < _heap[m]->_deadline))
+            m = r;
+
+        if (m == i)
+            break;
+
+        swap(i, m);
+        i = m;
+    }
+}
+
+NDPPD_NS_END
@@ -0,0 +1,96 @@
+// ndppd - NDP Proxy Daemon
+// Copyright (C) 2011  Daniel Adolfsson <daniel@priv.nu>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#pragma once
+
+#include <vector>
+#include <stdint.h>
+
+#include "ndppd.h"
+
+NDPPD_NS_BEGIN
+
+// A one-shot timer. All pending timers live in a single binary min-heap
+// ordered by deadline, so scheduling and cancelling are O(log n) and only
+// timers that actually expire are ever touched.
+class timer {
+public:
+    typedef void (*handler)(void* obj);
+
+    timer();
+
+    // Destructor; cancels the timer if it is pending.
+    ~timer();
+
+    // Sets the callback to invoke when the timer expires.
+    void bind(handler fn, void* obj);
+
+    // Binds the timer to a member function of obj.
+    template <class T, void (T::*M)()>
+    void bind(T* obj)
+    {
+        bind(&invoke<T, M>, obj);
+    }
+
+    // (Re)arms the timer to expire in ms milliseconds, but no sooner than
+    // the next millisecond; so a timer rearmed from its own callback
+    // isn't run again by the same run().
+    void schedule(int ms);
+
+    void cancel();
+
+    bool pending() const;
+
+    // Returns the current monotonic time in milliseconds.
+    static uint64_t now();
+
+    // Milliseconds until the first pending timer expires, or -1 if
+    // there are none.
+    static int next_timeout();
+
+    // Invokes the callback of every timer that has expired.
+    static void run();
+
+private:
+    // Never freed, so that timers destroyed on exit can still cancel.
+    static std::vector<timer*>& _heap;
+
+    uint64_t _deadline;
+
+    // Position in _heap, or -1 if not pending.
+    int _index;
+
+    handler _fn;
+
+    void* _obj;
+
+    static void sift_up(int i);
+
+    static void sift_down(int i);
+
+    static void swap(int i, int j);
+
+    template <class T, void (T::*M)()>
+    static void invoke(void* obj)
+    {
+        (static_cast<T*>(obj)->*M)();
+    }
+
+    timer(const timer&);
+
+    timer& operator=(const timer&);
+};
+
+NDPPD_NS_END
@@ -0,0 +1,286 @@
+// ndppd - NDP Proxy Daemon
+// Copyright (C) 2011  Daniel Adolfsson <daniel@priv.nu>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <netinet/in.h>
+
+#include "ndppd.h"
+
+NDPPD_NS_BEGIN
+
+// Path-compressed binary trie keyed on IPv6 prefixes. Every node stores
+// the values of one prefix; a lookup walks at most one node per distinct
+// prefix length on the path to the address, which makes it O(prefix
+// length) regardless of how many prefixes have been inserted.
+template <typename T>
+class trie {
+public:
+    trie() :
+        _root(0), _size(0)
+    {
+    }
+
+    ~trie()
+    {
+        clear();
+    }
+
+    void clear()
+    {
+        destroy(_root);
+        _root = 0;
+        _size = 0;
+    }
+
+    bool empty() const
+    {
+        return !_size;
+    }
+
+    // Number of values stored in the trie.
+    size_t size() const
+    {
+        return _size;
+    }
+
+    // Adds value under the prefix addr/addr.prefix().
+    void insert(const address& addr, const T& value)
+    {
+        int plen = addr.prefix();
+        struct in6_addr key;
+        masked(addr.const_addr(), plen, key);
+
+        node** link = &_root;
+
+        while (*link) {
+            node* n = *link;
+            int common = common_bits(n->key, key);
+
+            if (common > n->plen)
+                common = n->plen;
+
+            if (common > plen)
+                common = plen;
+
+            if (common < n->plen) {
+                // The new prefix diverges from (or is a parent of) this
+                // node, so split the edge leading to it.
+                node* split = new node(key, common);
+                split->child[bit(n->key, common)] = n;
+                *link = split;
+
+                if (common == plen) {
+                    split->values.push_back(value);
+                } else {
+                    node* leaf = new node(key, plen);
+                    leaf->values.push_back(value);
+                    split->child[bit(key, common)] = leaf;
+                }
+
+                _size++;
+                return;
+            }
+
+            if (n->plen == plen) {
+                n->values.push_back(value);
+                _size++;
+                return;
+            }
+
+            link = &n->child[bit(key, n->plen)];
+        }
+
+        *link = new node(key, plen);
+        (*link)->values.push_back(value);
+        _size++;
+    }
+
+    // Removes one occurrence of value stored under exactly addr/prefix.
+    bool remove(const address& addr, const T& value)
+    {
+        int plen = addr.prefix();
+        struct in6_addr key;
+        masked(addr.const_addr(), plen, key);
+
+        node** link = &_root;
+
+        while (*link) {
+            node* n = *link;
+
+            if ((n->plen > plen) || (common_bits(n->key, key) < n->plen))
+                return false;
+
+            if (n->plen == plen) {
+                typename std::vector<T>::iterator it =
+                    std::find(n->values.begin(), n->values.end(), value);
+
+                if (it == n->values.end())
+                    return false;
+
+                n->values.erase(it);
+                _size--;
+
+                // Drop nodes that no longer carry any information.
+                if (n->values.empty() && (!n->child[0] || !n->child[1])) {
+                    *link = n->child[0] ? n->child[0] : n->child[1];
+                    n->child[0] = n->child[1] = 0;
+                    delete n;
+                }
+
+                return true;
+            }
+
+            link = &n->child[bit(key, n->plen)];
+        }
+
+        return false;
+    }
+
+    // Returns the values stored under exactly addr/prefix, or NULL.
+    const std::vector<T>* find(const address& addr) const
+    {
+        int plen = addr.prefix();
+        struct in6_addr key;
+        masked(addr.const_addr(), plen, key);
+
+        for (node* n = _root; n; ) {
+            if ((n->plen > plen) || (common_bits(n->key, key) < n->plen))
+                break;
+
+            if (n->plen == plen)
+                return n->values.empty() ? 0 : &n->values;
+
+            n = n->child[bit(key, n->plen)];
+        }
+
+        return 0;
+    }
+
+    // Appends the values of every prefix containing addr to out, from
+    // the shortest prefix to the longest.
+    void match(const address& addr, std::vector<T>& out) const
+    {
+        const struct in6_addr& key = addr.const_addr();
+
+        for (node* n = _root; n; ) {
+            if (common_bits(n->key, key) < n->plen)
+                break;
+
+            out.insert(out.end(), n->values.begin(), n->values.end());
+
+            if (n->plen >= 128)
+                break;
+
+            n = n->child[bit(key, n->plen)];
+        }
+    }
+
+    // Stores the first value of the longest prefix containing addr in
+    // out. Returns false if no prefix matches.
+    bool longest(const address& addr, T& out) const
+    {
+        const struct in6_addr& key = addr.const_addr();
+        const node* best = 0;
+
+        for (node* n = _root; n; ) {
+            if (common_bits(n->key, key) < n->plen)
+                break;
+
+            if (!n->values.empty())
+                best = n;
+
+            if (n->plen >= 128)
+                break;
+
+            n = n->child[bit(key, n->plen)];
+        }
+
+        if (!best)
+            return false;
+
+        out = best->values.front();
+        return true;
+    }
+
+private:
+    struct node {
+        struct in6_addr key;
+        int plen;
+        node* child[2];
+        std::vector<T> values;
+
+        node(const struct in6_addr& k, int p) :
+            plen(p)
+        {
+            masked(k, p, key);
+            child[0] = child[1] = 0;
+        }
+    };
+
+    node* _root;
+
+    size_t _size;
+
+    static void destroy(node* n)
+    {
+        if (!n)
+            return;
+
+        destroy(n->child[0]);
+        destroy(n->child[1]);
+        delete n;
+    }
+
+    static int bit(const struct in6_addr& a, int i)
+    {
+        return (a.s6_addr[i >> 3] >> (7 - (i & 7))) & 1;
+    }
+
+    // Returns the number of leading bits a and b have in common.
+    static int common_bits(const struct in6_addr& a, const struct in6_addr& b)
+    {
+        for (int i = 0; i < 16; i++) {
+            unsigned char x = a.s6_addr[i] ^ b.s6_addr[i];
+
+            if (x)
+                return i * 8 + __builtin_clz((unsigned int)x) - 24;
+        }
+
+        return 128;
+    }
+
+    static void masked(const struct in6_addr& a, int plen, struct in6_addr& out)
+    {
+        for (int i = 0; i < 16; i++) {
+            int bits = plen - i * 8;
+
+            if (bits >= 8)
+                out.s6_addr[i] = a.s6_addr[i];
+            else if (bits <= 0)
+                out.s6_addr[i] = 0;
+            else
+                out.s6_addr[i] = a.s6_addr[i] & (0xff << (8 - bits));
+        }
+    }
+
+    trie(const trie&);
+
+    trie& operator=(const trie&);
+};
+
+NDPPD_NS_END
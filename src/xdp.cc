@@ -0,0 +1,398 @@
+// ndppd - NDP Proxy Daemon
+// Copyright (C) 2011  Daniel Adolfsson <daniel@priv.nu>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#include <cstddef>
+#include <cstring>
+#include <vector>
+
+#include <unistd.h>
+#include <errno.h>
+#include <strings.h>
+#include <sys/syscall.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <netinet/icmp6.h>
+#include <linux/bpf.h>
+#include <linux/if_link.h>
+
+#include "ndppd.h"
+#include "xdp.h"
+
+NDPPD_NS_BEGIN
+
+// Offsets into a solicit with a Source Link-Layer Address option, which
+// is rewritten into an advert with a Target Link-Layer Address option
+// of the same size.
+enum {
+    OFF_ETH_DST  = 0,
+    OFF_ETH_SRC  = 6,
+    OFF_ETH_TYPE = 12,
+    OFF_IP6      = 14,
+    OFF_IP6_PLEN = 18,
+    OFF_IP6_NXT  = 20,
+    OFF_IP6_HLIM = 21,
+    OFF_IP6_SRC  = 22,
+    OFF_IP6_DST  = 38,
+    OFF_ICMP6    = 54,
+    OFF_CKSUM    = 56,
+    OFF_FLAGS    = 58,
+    OFF_TARGET   = 62,
+    OFF_OPT      = 78,
+    OFF_LLADDR   = 80,
+    OFF_END      = 86
+};
+
+typedef std::vector<struct bpf_insn> ebpf_prog;
+
+static struct bpf_insn ebpf(uint8_t code, uint8_t dst, uint8_t src, int16_t off, int32_t imm)
+{
+    struct bpf_insn insn;
+    insn.code    = code;
+    insn.dst_reg = dst;
+    insn.src_reg = src;
+    insn.off     = off;
+    insn.imm     = imm;
+    return insn;
+}
+
+// Returns the bytes at p as the register value a load of size len
+// from the packet would produce.
+static int32_t ebpf_bytes(const void* p, size_t len)
+{
+    uint32_t w = 0;
+    memcpy(&w, p, len);
+    return (int32_t)w;
+}
+
+static int32_t ebpf_word(uint8_t a, uint8_t b, uint8_t c = 0, uint8_t d = 0)
+{
+    uint8_t buf[4] = { a, b, c, d };
+    return ebpf_bytes(buf, 4);
+}
+
+static int bpf(int cmd, union bpf_attr* attr)
+{
+    return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+xdp::xdp() :
+    _ifindex(0), _mode(NATIVE), _map_fd(-1), _prog_fd(-1), _link_fd(-1)
+{
+    memset(&_hwaddr, 0, sizeof(_hwaddr));
+}
+
+xdp::~xdp()
+{
+    unload();
+
+    if (_map_fd >= 0)
+        close(_map_fd);
+}
+
+ptr<xdp> xdp::open(const std::string& ifname, int mode)
+{
+    ptr<xdp> x(new xdp());
+
+    x->_name = ifname;
+    x->_mode = mode;
+
+    if (!(x->_ifindex = if_nametoindex(ifname.c_str()))) {
+        logger::error() << "Failed to set up XDP on interface '" << ifname << "': no such interface";
+        return ptr<xdp>();
+    }
+
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type    = BPF_MAP_TYPE_HASH;
+    attr.key_size    = sizeof(struct in6_addr);
+    attr.value_size  = sizeof(entry);
+    attr.max_entries = MAP_SIZE;
+    strncpy(attr.map_name, "ndppd_targets", sizeof(attr.map_name) - 1);
+
+    if ((x->_map_fd = bpf(BPF_MAP_CREATE, &attr)) < 0) {
+        logger::error() << "Failed to create XDP map for interface '" << ifname << "': " << logger::err();
+        return ptr<xdp>();
+    }
+
+    NDPPD_DEBUG << "xdp::open() ifname=" << ifname << ", map_fd=" << x->_map_fd;
+
+    return x;
+}
+
+bool xdp::load(const struct ether_addr& hwaddr, const address& saddr)
+{
+    if ((_prog_fd >= 0) && !memcmp(&_hwaddr, &hwaddr, sizeof(hwaddr)) && (_saddr == saddr))
+        return true;
+
+    ebpf_prog prog;
+    std::vector<size_t> to_pass;
+
+    const uint8_t* hw = (const uint8_t* )&hwaddr;
+    const uint8_t* sa = (const uint8_t* )&saddr.const_addr();
+
+    // r8 = start of the packet, r9 = end of the packet.
+    prog.push_back(ebpf(BPF_LDX | BPF_MEM | BPF_W, 8, 1, offsetof(struct xdp_md, data), 0));
+    prog.push_back(ebpf(BPF_LDX | BPF_MEM | BPF_W, 9, 1, offsetof(struct xdp_md, data_end), 0));
+    prog.push_back(ebpf(BPF_ALU64 | BPF_MOV | BPF_X, 2, 8, 0, 0));
+    prog.push_back(ebpf(BPF_ALU64 | BPF_ADD | BPF_K, 2, 0, 0, OFF_END));
+    to_pass.push_back(prog.size());
+    prog.push_back(ebpf(BPF_JMP | BPF_JGT | BPF_X, 2, 9, 0, 0));
+
+    // Bail unless it's an ICMPv6 solicit with nothing but a Source
+    // Link-Layer Address option, from a unicast address.
+    struct { uint8_t size; int16_t off; int32_t value; int op; } checks[] = {
+        { BPF_H, OFF_ETH_TYPE, ebpf_word(ETHERTYPE_IPV6 >> 8, ETHERTYPE_IPV6 & 0xff), BPF_JNE },
+        { BPF_H, OFF_IP6_PLEN, ebpf_word(0, OFF_END - OFF_ICMP6), BPF_JNE },
+        { BPF_B, OFF_IP6_NXT,  IPPROTO_ICMPV6, BPF_JNE },
+        { BPF_B, OFF_IP6_HLIM, 255, BPF_JNE },
+        { BPF_H, OFF_ICMP6,    ebpf_word(ND_NEIGHBOR_SOLICIT, 0), BPF_JNE },
+        { BPF_H, OFF_OPT,      ebpf_word(ND_OPT_SOURCE_LINKADDR, 1), BPF_JNE },
+        { BPF_B, OFF_IP6_SRC,  0xff, BPF_JEQ }
+    };
+
+    for (size_t i = 0; i < sizeof(checks) / sizeof(checks[0]); i++) {
+        prog.push_back(ebpf(BPF_LDX | BPF_MEM | checks[i].size, 2, 8, checks[i].off, 0));
+        to_pass.push_back(prog.size());
+        prog.push_back(ebpf(BPF_JMP | checks[i].op | BPF_K, 2, 0, 0, checks[i].value));
+    }
+
+    // Leave solicits from the target itself to proxy::handle_solicit().
+    prog.push_back(ebpf(BPF_LDX | BPF_MEM | BPF_DW, 2, 8, OFF_TARGET, 0));
+    prog.push_back(ebpf(BPF_LDX | BPF_MEM | BPF_DW, 3, 8, OFF_IP6_SRC, 0));
+    prog.push_back(ebpf(BPF_JMP | BPF_JNE | BPF_X, 2, 3, 3, 0));
+    prog.push_back(ebpf(BPF_LDX | BPF_MEM | BPF_DW, 2, 8, OFF_TARGET + 8, 0));
+    prog.push_back(ebpf(BPF_LDX | BPF_MEM | BPF_DW, 3, 8, OFF_IP6_SRC + 8, 0));
+    to_pass.push_back(prog.size());
+    prog.push_back(ebpf(BPF_JMP | BPF_JEQ | BPF_X, 2, 3, 0, 0));
+
+    // r0 = map entry of the target, or bail.
+    prog.push_back(ebpf(BPF_LDX | BPF_MEM | BPF_DW, 2, 8, OFF_TARGET, 0));
+    prog.push_back(ebpf(BPF_STX | BPF_MEM | BPF_DW, 10, 2, -16, 0));
+    prog.push_back(ebpf(BPF_LDX | BPF_MEM | BPF_DW, 2, 8, OFF_TARGET + 8, 0));
+    prog.push_back(ebpf(BPF_STX | BPF_MEM | BPF_DW, 10, 2, -8, 0));
+    prog.push_back(ebpf(BPF_LD | BPF_DW | BPF_IMM, 1, BPF_PSEUDO_MAP_FD, 0, _map_fd));
+    prog.push_back(ebpf(0, 0, 0, 0, 0));
+    prog.push_back(ebpf(BPF_ALU64 | BPF_MOV | BPF_X, 2, 10, 0, 0));
+    prog.push_back(ebpf(BPF_ALU64 | BPF_ADD | BPF_K, 2, 0, 0, -16));
+    prog.push_back(ebpf(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem));
+    to_pass.push_back(prog.size());
+    prog.push_back(ebpf(BPF_JMP | BPF_JEQ | BPF_K, 0, 0, 0, 0));
+
+    // entry::hits++, r7 = entry::flags.
+    prog.push_back(ebpf(BPF_ALU64 | BPF_MOV | BPF_K, 1, 0, 0, 1));
+    prog.push_back(ebpf(BPF_STX | BPF_ATOMIC | BPF_DW, 0, 1, offsetof(entry, hits), BPF_ADD));
+    prog.push_back(ebpf(BPF_LDX | BPF_MEM | BPF_W, 7, 0, offsetof(entry, flags), 0));
+
+    // Ethernet: back to the sender, from us.
+    prog.push_back(ebpf(BPF_LDX | BPF_MEM | BPF_W, 1, 8, OFF_ETH_SRC, 0));
+    prog.push_back(ebpf(BPF_STX | BPF_MEM | BPF_W, 8, 1, OFF_ETH_DST, 0));
+    prog.push_back(ebpf(BPF_LDX | BPF_MEM | BPF_H, 1, 8, OFF_ETH_SRC + 4, 0));
+    prog.push_back(ebpf(BPF_STX | BPF_MEM | BPF_H, 8, 1, OFF_ETH_DST + 4, 0));
+    prog.push_back(ebpf(BPF_ST | BPF_MEM | BPF_W, 8, 0, OFF_ETH_SRC, ebpf_bytes(hw, 4)));
+    prog.push_back(ebpf(BPF_ST | BPF_MEM | BPF_H, 8, 0, OFF_ETH_SRC + 4, ebpf_bytes(hw + 4, 2)));
+
+    // IPv6: back to the sender, from saddr. Length, next header and
+    // hop limit stay as they are.
+    prog.push_back(ebpf(BPF_ST | BPF_MEM | BPF_W, 8, 0, OFF_IP6, ebpf_word(0x60, 0)));
+    prog.push_back(ebpf(BPF_LDX | BPF_MEM | BPF_DW, 1, 8, OFF_IP6_SRC, 0));
+    prog.push_back(ebpf(BPF_STX | BPF_MEM | BPF_DW, 8, 1, OFF_IP6_DST, 0));
+    prog.push_back(ebpf(BPF_LDX | BPF_MEM | BPF_DW, 1, 8, OFF_IP6_SRC + 8, 0));
+    prog.push_back(ebpf(BPF_STX | BPF_MEM | BPF_DW, 8, 1, OFF_IP6_DST + 8, 0));
+
+    for (int i = 0; i < 4; i++)
+        prog.push_back(ebpf(BPF_ST | BPF_MEM | BPF_W, 8, 0, OFF_IP6_SRC + i * 4, ebpf_bytes(sa + i * 4, 4)));
+
+    // ICMPv6: the advert, with the checksum zeroed for now. The target
+    // stays where it is.
+    prog.push_back(ebpf(BPF_ST | BPF_MEM | BPF_W, 8, 0, OFF_ICMP6, ebpf_word(ND_NEIGHBOR_ADVERT, 0)));
+    prog.push_back(ebpf(BPF_STX | BPF_MEM | BPF_W, 8, 7, OFF_FLAGS, 0));
+    prog.push_back(ebpf(BPF_ST | BPF_MEM | BPF_H, 8, 0, OFF_OPT, ebpf_word(ND_OPT_TARGET_LINKADDR, 1)));
+    prog.push_back(ebpf(BPF_ST | BPF_MEM | BPF_W, 8, 0, OFF_LLADDR, ebpf_bytes(hw, 4)));
+    prog.push_back(ebpf(BPF_ST | BPF_MEM | BPF_H, 8, 0, OFF_LLADDR + 4, ebpf_bytes(hw + 4, 2)));
+
+    // The addresses and the message are contiguous; the rest of the
+    // pseudo-header is the length and next header.
+    prog.push_back(ebpf(BPF_ALU64 | BPF_MOV | BPF_K, 1, 0, 0, 0));
+    prog.push_back(ebpf(BPF_ALU64 | BPF_MOV | BPF_K, 2, 0, 0, 0));
+    prog.push_back(ebpf(BPF_ALU64 | BPF_MOV | BPF_X, 3, 8, 0, 0));
+    prog.push_back(ebpf(BPF_ALU64 | BPF_ADD | BPF_K, 3, 0, 0, OFF_IP6_SRC));
+    prog.push_back(ebpf(BPF_ALU64 | BPF_MOV | BPF_K, 4, 0, 0, OFF_END - OFF_IP6_SRC));
+    prog.push_back(ebpf(BPF_ALU64 | BPF_MOV | BPF_K, 5, 0, 0,
+        ebpf_word(0, 0, 0, (OFF_END - OFF_ICMP6) + IPPROTO_ICMPV6)));
+    prog.push_back(ebpf(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_csum_diff));
+
+    prog.push_back(ebpf(BPF_ALU | BPF_MOV | BPF_X, 0, 0, 0, 0));
+
+    for (int i = 0; i < 2; i++) {
+        prog.push_back(ebpf(BPF_ALU64 | BPF_MOV | BPF_X, 1, 0, 0, 0));
+        prog.push_back(ebpf(BPF_ALU64 | BPF_RSH | BPF_K, 1, 0, 0, 16));
+        prog.push_back(ebpf(BPF_ALU64 | BPF_AND | BPF_K, 0, 0, 0, 0xffff));
+        prog.push_back(ebpf(BPF_ALU64 | BPF_ADD | BPF_X, 0, 1, 0, 0));
+    }
+
+    prog.push_back(ebpf(BPF_ALU64 | BPF_XOR | BPF_K, 0, 0, 0, 0xffff));
+    prog.push_back(ebpf(BPF_STX | BPF_MEM | BPF_H, 8, 0, OFF_CKSUM, 0));
+
+    prog.push_back(ebpf(BPF_ALU64 | BPF_MOV | BPF_K, 0, 0, 0, XDP_TX));
+    prog.push_back(ebpf(BPF_JMP | BPF_EXIT, 0, 0, 0, 0));
+
+    for (std::vector<size_t>::iterator it = to_pass.begin(); it != to_pass.end(); it++)
+        prog[*it].off = prog.size() - *it - 1;
+
+    prog.push_back(ebpf(BPF_ALU64 | BPF_MOV | BPF_K, 0, 0, 0, XDP_PASS));
+    prog.push_back(ebpf(BPF_JMP | BPF_EXIT, 0, 0, 0, 0));
+
+    static char log[16384];
+    log[0] = '\0';
+
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type            = BPF_PROG_TYPE_XDP;
+    attr.expected_attach_type = BPF_XDP;
+    attr.insns                = (uint64_t)(unsigned long)&prog[0];
+    attr.insn_cnt             = prog.size();
+    attr.license              = (uint64_t)(unsigned long)"GPL";
+    attr.log_buf              = (uint64_t)(unsigned long)log;
+    attr.log_size             = sizeof(log);
+    attr.log_level            = 1;
+    strncpy(attr.prog_name, "ndppd_xdp", sizeof(attr.prog_name) - 1);
+
+    int fd;
+
+    if ((fd = bpf(BPF_PROG_LOAD, &attr)) < 0) {
+        logger::error() << "Failed to load XDP program for interface '" << _name << "': " << logger::err();
+        NDPPD_DEBUG << log;
+        return false;
+    }
+
+    if (_link_fd >= 0) {
+        memset(&attr, 0, sizeof(attr));
+        attr.link_update.link_fd     = _link_fd;
+        attr.link_update.new_prog_fd = fd;
+
+        if (bpf(BPF_LINK_UPDATE, &attr) < 0) {
+            logger::error() << "Failed to replace XDP program on interface '" << _name << "': " << logger::err();
+            close(fd);
+            return false;
+        }
+    } else {
+        memset(&attr, 0, sizeof(attr));
+        attr.link_create.prog_fd        = fd;
+        attr.link_create.target_ifindex = _ifindex;
+        attr.link_create.attach_type    = BPF_XDP;
+        attr.link_create.flags          = (_mode == GENERIC) ? XDP_FLAGS_SKB_MODE : XDP_FLAGS_DRV_MODE;
+
+        // The link goes away with us, so nothing stays behind on the
+        // interface if we crash.
+        if ((_link_fd = bpf(BPF_LINK_CREATE, &attr)) < 0) {
+            logger::error() << "Failed to attach XDP program to interface '" << _name << "': " << logger::err();
+            close(fd);
+            return false;
+        }
+    }
+
+    if (_prog_fd >= 0)
+        close(_prog_fd);
+
+    _prog_fd = fd;
+    _hwaddr  = hwaddr;
+    _saddr   = saddr;
+
+    NDPPD_DEBUG << "xdp::load() ifname=" << _name << ", saddr=" << saddr.to_string()
+                    << ", insns=" << (int)prog.size();
+
+    return true;
+}
+
+void xdp::unload()
+{
+    if (_link_fd >= 0) {
+        close(_link_fd);
+        _link_fd = -1;
+    }
+
+    if (_prog_fd >= 0) {
+        close(_prog_fd);
+        _prog_fd = -1;
+    }
+}
+
+void xdp::add(const address& taddr, bool router)
+{
+    if (_refs[taddr]++)
+        return;
+
+    entry e;
+    memset(&e, 0, sizeof(e));
+    e.flags = ND_NA_FLAG_SOLICITED | (router ? ND_NA_FLAG_ROUTER : 0);
+
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = _map_fd;
+    attr.key    = (uint64_t)(unsigned long)&taddr.const_addr();
+    attr.value  = (uint64_t)(unsigned long)&e;
+    attr.flags  = BPF_ANY;
+
+    if (bpf(BPF_MAP_UPDATE_ELEM, &attr) < 0)
+        logger::warning() << "Failed to add " << taddr.to_string() << " to the XDP map of '" << _name << "': " << logger::err();
+}
+
+void xdp::remove(const address& taddr)
+{
+    int* ref = _refs.find(taddr);
+
+    if (!ref || --(*ref) > 0)
+        return;
+
+    _refs.erase(taddr);
+
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = _map_fd;
+    attr.key    = (uint64_t)(unsigned long)&taddr.const_addr();
+
+    bpf(BPF_MAP_DELETE_ELEM, &attr);
+}
+
+uint64_t xdp::hits(const address& taddr)
+{
+    entry e;
+    memset(&e, 0, sizeof(e));
+
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = _map_fd;
+    attr.key    = (uint64_t)(unsigned long)&taddr.const_addr();
+    attr.value  = (uint64_t)(unsigned long)&e;
+
+    if (bpf(BPF_MAP_LOOKUP_ELEM, &attr) < 0)
+        return 0;
+
+    return e.hits;
+}
+
+int xdp::parse_mode(const std::string& str)
+{
+    if (!strcasecmp(str.c_str(), "native") || !strcasecmp(str.c_str(), "yes") ||
+            !strcasecmp(str.c_str(), "true"))
+        return NATIVE;
+
+    if (!strcasecmp(str.c_str(), "generic"))
+        return GENERIC;
+
+    return -1;
+}
+
+NDPPD_NS_END
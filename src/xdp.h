@@ -0,0 +1,97 @@
+// ndppd - NDP Proxy Daemon
+// Copyright (C) 2011  Daniel Adolfsson <daniel@priv.nu>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#pragma once
+
+#include <string>
+
+#include <net/ethernet.h>
+#include <stdint.h>
+
+#include "ndppd.h"
+#include "addr_map.h"
+
+NDPPD_NS_BEGIN
+
+// An XDP program on a proxy interface that answers Neighbor Solicitations
+// for targets in its map without waking us up. Anything it doesn't
+// answer is passed on to the PF_PACKET socket as before.
+//
+// The program is generated here and loaded with bpf(2) directly, so
+// there is nothing to build or install besides ndppd itself.
+class xdp : public ref_counted {
+public:
+    enum {
+        NATIVE,  // Attach in the driver.
+        GENERIC  // Attach after the skb has been built; works everywhere.
+    };
+
+    // Creates the target map for ifname. The program isn't attached
+    // until load() is called.
+    static ptr<xdp> open(const std::string& ifname, int mode);
+
+    // Destructor. Detaches the program.
+    ~xdp();
+
+    // Generates the program for adverts from hwaddr and saddr and
+    // attaches it, or replaces the one already attached.
+    bool load(const struct ether_addr& hwaddr, const address& saddr);
+
+    // Detaches the program but keeps the map.
+    void unload();
+
+    // Answers solicits for taddr from now on.
+    void add(const address& taddr, bool router);
+
+    void remove(const address& taddr);
+
+    // Number of solicits for taddr answered by the program since add().
+    uint64_t hits(const address& taddr);
+
+    // Parses the value of the "xdp" option; returns -1 if it is off.
+    static int parse_mode(const std::string& str);
+
+private:
+    enum { MAP_SIZE = 65536 };
+
+    // Value of a map entry.
+    struct entry {
+        // nd_na_flags_reserved of the advert.
+        uint32_t flags;
+
+        uint32_t pad;
+
+        uint64_t hits;
+    };
+
+    std::string _name;
+
+    int _ifindex;
+
+    int _mode;
+
+    int _map_fd, _prog_fd, _link_fd;
+
+    struct ether_addr _hwaddr;
+
+    address _saddr;
+
+    // Number of sessions that added each target.
+    addr_map<int> _refs;
+
+    xdp();
+};
+
+NDPPD_NS_END